@@ -6,248 +6,2944 @@
 #include <io.h>
 #include <direct.h>
 #include <stdint.h>
+#include <stdarg.h>
 #define PCRE2_CODE_UNIT_WIDTH 8
 #define PCRE2_STATIC
 #include <pcre2.h>
+#include <zlib.h>
+#include <zstd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
+// Match a file name against a glob: '*' matches any run of characters
+// ('**' is the same), '?' one character, '[...]' one character of a set
+// ('!' or '^' negates it, 'a-z' is a range) and '\' quotes the next
+// character.
 int match_glob(const char *pattern, const char *string) {
-    if (strchr(pattern, '*') == NULL && strchr(pattern, '?') == NULL) {
-        return strcmp(pattern, string) == 0;
-    }
-    char *star = strchr(pattern, '*');
-    if (star) {
-        int prefix_len = star - pattern;
-        if (strncmp(pattern, string, prefix_len) != 0) return 0;
-        const char *suffix = star + 1;
-        int suffix_len = strlen(suffix);
-        int str_len = strlen(string);
-        if (suffix_len == 0) return 1;
-        if (str_len < prefix_len + suffix_len) return 0;
-        return strcmp(string + str_len - suffix_len, suffix) == 0;
-    }
-    // for ?, simple char match
-    int pat_len = strlen(pattern);
-    int str_len = strlen(string);
-    if (pat_len != str_len) return 0;
-    for (int i = 0; i < pat_len; i++) {
-        if (pattern[i] != '?' && pattern[i] != string[i]) return 0;
+    const char *star = NULL;
+    const char *resume = NULL;
+    while (*string) {
+        const char *p = pattern;
+        int ok = 0;
+        if (*p == '*') {
+            while (*pattern == '*') pattern++;
+            if (!*pattern) return 1;
+            star = pattern;
+            resume = string;
+            continue;
+        } else if (*p == '?') {
+            ok = 1;
+            pattern++;
+        } else if (*p == '[') {
+            p++;
+            int negate = *p == '!' || *p == '^';
+            if (negate) p++;
+            int in = 0;
+            const char *q = p;
+            do {
+                unsigned char lo = (unsigned char)*q;
+                if (lo == '\\' && q[1]) lo = (unsigned char)*++q;
+                unsigned char hi = lo;
+                if (q[1] == '-' && q[2] && q[2] != ']') {
+                    q += 2;
+                    hi = (unsigned char)*q;
+                    if (hi == '\\' && q[1]) hi = (unsigned char)*++q;
+                }
+                if ((unsigned char)*string >= lo && (unsigned char)*string <= hi) in = 1;
+                q++;
+            } while (*q && *q != ']');
+            if (*q == ']') {
+                ok = in != negate;
+                pattern = q + 1;
+            } else {
+                // No closing bracket: '[' is an ordinary character.
+                ok = *string == '[';
+                pattern++;
+            }
+        } else {
+            if (*p == '\\' && p[1]) p++;
+            ok = *p == *string;
+            pattern = p + 1;
+        }
+        if (ok) {
+            string++;
+        } else if (star) {
+            pattern = star;
+            string = ++resume;
+        } else {
+            return 0;
+        }
+    }
+    while (*pattern == '*') pattern++;
+    return !*pattern;
+}
+
+// The --include, --exclude and --exclude-dir globs, each with the index
+// of the option that gave it.  Plain names and '*.ext' globs are looked
+// up by hash; only the other globs are matched one by one.
+typedef struct {
+    char *key;
+    int rule;
+} GlobEntry;
+
+typedef struct {
+    GlobEntry *names;
+    int names_cap;
+    int num_names;
+    GlobEntry *extensions;
+    int extensions_cap;
+    int num_extensions;
+    GlobEntry *globs;
+    int num_globs;
+} GlobSet;
+
+unsigned glob_hash(const char *s) {
+    unsigned h = 2166136261u;
+    while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+GlobEntry *glob_table_find(GlobEntry *table, int cap, const char *key) {
+    for (unsigned i = glob_hash(key) & (cap - 1);; i = (i + 1) & (cap - 1)) {
+        if (!table[i].key || strcmp(table[i].key, key) == 0) return &table[i];
+    }
+}
+
+void glob_table_add(GlobEntry **table, int *cap, int *count, const char *key, int rule) {
+    if ((*count + 1) * 2 > *cap) {
+        int old_cap = *cap;
+        GlobEntry *old = *table;
+        *cap = old_cap ? old_cap * 2 : 16;
+        *table = calloc(*cap, sizeof(GlobEntry));
+        for (int i = 0; i < old_cap; i++) {
+            if (old[i].key) *glob_table_find(*table, *cap, old[i].key) = old[i];
+        }
+        free(old);
+    }
+    GlobEntry *e = glob_table_find(*table, *cap, key);
+    if (!e->key) {
+        e->key = _strdup(key);
+        (*count)++;
+    }
+    e->rule = rule;
+}
+
+int glob_table_lookup(GlobEntry *table, int cap, const char *key) {
+    if (!table) return -1;
+    GlobEntry *e = glob_table_find(table, cap, key);
+    return e->key ? e->rule : -1;
+}
+
+void glob_set_add(GlobSet **setp, const char *glob, int rule) {
+    if (!*setp) *setp = calloc(1, sizeof(GlobSet));
+    GlobSet *set = *setp;
+    if (!strpbrk(glob, "*?[\\")) {
+        glob_table_add(&set->names, &set->names_cap, &set->num_names, glob, rule);
+    } else if (glob[0] == '*' && glob[1] == '.' && glob[2] && !strpbrk(glob + 2, "*?[\\.")) {
+        glob_table_add(&set->extensions, &set->extensions_cap, &set->num_extensions, glob + 2, rule);
+    } else {
+        set->globs = realloc(set->globs, (set->num_globs + 1) * sizeof(GlobEntry));
+        set->globs[set->num_globs].key = _strdup(glob);
+        set->globs[set->num_globs].rule = rule;
+        set->num_globs++;
+    }
+}
+
+// The index of the last option in set whose glob matches name, or -1.
+int glob_set_match(GlobSet *set, const char *name) {
+    if (!set) return -1;
+    int best = glob_table_lookup(set->names, set->names_cap, name);
+    const char *dot = strrchr(name, '.');
+    if (dot) {
+        int rule = glob_table_lookup(set->extensions, set->extensions_cap, dot + 1);
+        if (rule > best) best = rule;
+    }
+    // Globs are kept in option order, so the last one to match wins.
+    for (int i = set->num_globs - 1; i >= 0 && set->globs[i].rule > best; i--) {
+        if (match_glob(set->globs[i].key, name)) return set->globs[i].rule;
+    }
+    return best;
+}
+
+unsigned char fold_table[256];
+unsigned char word_table[256];
+
+int mem_equal_icase(const char *a, const char *b, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (fold_table[(unsigned char)a[i]] != fold_table[(unsigned char)b[i]]) return 0;
     }
     return 1;
 }
 
-int contains_ignore_case(const char *haystack, const char *needle) {
-    size_t len = strlen(needle);
-    for (const char *p = haystack; *p; p++) {
-        if (_strnicmp(p, needle, len) == 0) return 1;
+int is_word_char(unsigned char c) {
+    return word_table[c];
+}
+
+// Lines are not NUL-terminated inside the read buffer, so all literal
+// searching works on explicit lengths.
+const char *find_fixed_scalar(const char *hay, size_t hay_len, const char *needle, size_t needle_len, int ignore_case) {
+    if (needle_len == 0) return hay;
+    if (needle_len > hay_len) return NULL;
+    const char *last = hay + hay_len - needle_len;
+    for (const char *p = hay; p <= last; p++) {
+        if (ignore_case) {
+            if (fold_table[(unsigned char)*p] == fold_table[(unsigned char)*needle] && mem_equal_icase(p, needle, needle_len)) return p;
+        } else {
+            p = memchr(p, *needle, last - p + 1);
+            if (!p) return NULL;
+            if (memcmp(p, needle, needle_len) == 0) return p;
+        }
+    }
+    return NULL;
+}
+
+#ifdef HAVE_X86_SIMD
+// Vector kernels test the first and last needle byte at every position of
+// a block at once and only compare the middle of the needle where both
+// agree.  Case folding is ASCII only: each end byte is compared against
+// both its lower and upper case form.
+__attribute__((target("sse2")))
+const char *find_fixed_sse2(const char *hay, size_t hay_len, const char *needle, size_t needle_len, int ignore_case) {
+    if (needle_len == 0) return hay;
+    if (needle_len > hay_len) return NULL;
+    if (needle_len == 1 && !ignore_case) return memchr(hay, *needle, hay_len);
+    unsigned char first = (unsigned char)needle[0];
+    unsigned char last = (unsigned char)needle[needle_len-1];
+    __m128i first_lo = _mm_set1_epi8((char)(ignore_case ? tolower(first) : first));
+    __m128i first_up = _mm_set1_epi8((char)(ignore_case ? toupper(first) : first));
+    __m128i last_lo = _mm_set1_epi8((char)(ignore_case ? tolower(last) : last));
+    __m128i last_up = _mm_set1_epi8((char)(ignore_case ? toupper(last) : last));
+    size_t positions = hay_len - needle_len + 1;
+    size_t i = 0;
+    for (; i + 16 <= positions; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + needle_len - 1));
+        __m128i hit = _mm_and_si128(_mm_or_si128(_mm_cmpeq_epi8(a, first_lo), _mm_cmpeq_epi8(a, first_up)),
+                           _mm_or_si128(_mm_cmpeq_epi8(b, last_lo), _mm_cmpeq_epi8(b, last_up)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+        while (mask) {
+            int k = __builtin_ctz(mask);
+            mask &= mask - 1;
+            const char *p = hay + i + k;
+            if (needle_len <= 2) return p;
+            if (ignore_case ? mem_equal_icase(p + 1, needle + 1, needle_len - 2)
+                            : memcmp(p + 1, needle + 1, needle_len - 2) == 0) return p;
+        }
+    }
+    return find_fixed_scalar(hay + i, hay_len - i, needle, needle_len, ignore_case);
+}
+
+__attribute__((target("avx2")))
+const char *find_fixed_avx2(const char *hay, size_t hay_len, const char *needle, size_t needle_len, int ignore_case) {
+    if (needle_len == 0) return hay;
+    if (needle_len > hay_len) return NULL;
+    if (needle_len == 1 && !ignore_case) return memchr(hay, *needle, hay_len);
+    unsigned char first = (unsigned char)needle[0];
+    unsigned char last = (unsigned char)needle[needle_len-1];
+    __m256i first_lo = _mm256_set1_epi8((char)(ignore_case ? tolower(first) : first));
+    __m256i first_up = _mm256_set1_epi8((char)(ignore_case ? toupper(first) : first));
+    __m256i last_lo = _mm256_set1_epi8((char)(ignore_case ? tolower(last) : last));
+    __m256i last_up = _mm256_set1_epi8((char)(ignore_case ? toupper(last) : last));
+    size_t positions = hay_len - needle_len + 1;
+    size_t i = 0;
+    for (; i + 32 <= positions; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(hay + i + needle_len - 1));
+        __m256i hit = _mm256_and_si256(_mm256_or_si256(_mm256_cmpeq_epi8(a, first_lo), _mm256_cmpeq_epi8(a, first_up)),
+                           _mm256_or_si256(_mm256_cmpeq_epi8(b, last_lo), _mm256_cmpeq_epi8(b, last_up)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        while (mask) {
+            int k = __builtin_ctz(mask);
+            mask &= mask - 1;
+            const char *p = hay + i + k;
+            if (needle_len <= 2) return p;
+            if (ignore_case ? mem_equal_icase(p + 1, needle + 1, needle_len - 2)
+                            : memcmp(p + 1, needle + 1, needle_len - 2) == 0) return p;
+        }
+    }
+    return find_fixed_scalar(hay + i, hay_len - i, needle, needle_len, ignore_case);
+}
+#endif
+
+const char *(*find_fixed_kernel)(const char *, size_t, const char *, size_t, int) = find_fixed_scalar;
+
+size_t count_byte_scalar(const char *s, size_t n, char c) {
+    size_t count = 0;
+    const char *end = s + n;
+    while (s < end) {
+        const char *p = memchr(s, c, end - s);
+        if (!p) break;
+        count++;
+        s = p + 1;
+    }
+    return count;
+}
+
+#ifdef HAVE_X86_SIMD
+// Byte counting keeps one 8-bit counter per lane, subtracting the all-ones
+// compare result, and folds the counters into 64-bit sums with psadbw
+// before they can overflow.
+__attribute__((target("sse2")))
+size_t count_byte_sse2(const char *s, size_t n, char c) {
+    __m128i needle = _mm_set1_epi8(c);
+    __m128i zero = _mm_setzero_si128();
+    __m128i total = zero;
+    size_t i = 0;
+    while (i + 16 <= n) {
+        __m128i lanes = zero;
+        size_t stop = i + 255 * 16 < n ? i + 255 * 16 : n;
+        for (; i + 16 <= stop; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+            lanes = _mm_sub_epi8(lanes, _mm_cmpeq_epi8(v, needle));
+        }
+        total = _mm_add_epi64(total, _mm_sad_epu8(lanes, zero));
+    }
+    uint64_t sums[2];
+    _mm_storeu_si128((__m128i *)sums, total);
+    return (size_t)(sums[0] + sums[1]) + count_byte_scalar(s + i, n - i, c);
+}
+
+__attribute__((target("avx2")))
+size_t count_byte_avx2(const char *s, size_t n, char c) {
+    __m256i needle = _mm256_set1_epi8(c);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i total = zero;
+    size_t i = 0;
+    while (i + 32 <= n) {
+        __m256i lanes = zero;
+        size_t stop = i + 255 * 32 < n ? i + 255 * 32 : n;
+        for (; i + 32 <= stop; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+            lanes = _mm256_sub_epi8(lanes, _mm256_cmpeq_epi8(v, needle));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(lanes, zero));
     }
+    uint64_t sums[4];
+    _mm256_storeu_si256((__m256i *)sums, total);
+    return (size_t)(sums[0] + sums[1] + sums[2] + sums[3]) + count_byte_scalar(s + i, n - i, c);
+}
+#endif
+
+size_t (*count_byte_kernel)(const char *, size_t, char) = count_byte_scalar;
+
+const char *find_fixed(const char *hay, size_t hay_len, const char *needle, size_t needle_len, int ignore_case) {
+    return find_fixed_kernel(hay, hay_len, needle, needle_len, ignore_case);
+}
+
+int cpu_has_ssse3(void) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+#else
     return 0;
+#endif
+}
+
+// Fill the byte tables and pick the widest literal search kernel the CPU
+// supports.
+void init_search_kernels(void) {
+    for (int c = 0; c < 256; c++) {
+        fold_table[c] = (unsigned char)tolower(c);
+        word_table[c] = isalnum(c) || c == '_';
+    }
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        find_fixed_kernel = find_fixed_avx2;
+        count_byte_kernel = count_byte_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        find_fixed_kernel = find_fixed_sse2;
+        count_byte_kernel = count_byte_sse2;
+    }
+#endif
+}
+
+const char *mem_rchr(const char *s, char c, size_t n) {
+    while (n > 0) {
+        if (s[--n] == c) return s + n;
+    }
+    return NULL;
 }
 
-#define MAX_PATTERNS 100
-#define MAX_LINE 4096
+// Number of lines in [from, to), counting an unterminated last line.
+long long count_lines(const char *from, const char *to, char eol) {
+    if (from >= to) return 0;
+    return (long long)count_byte_kernel(from, to - from, eol) + (to[-1] != eol);
+}
+
+// Start of the line containing pos, never looking before start.
+const char *line_begin(const char *start, const char *pos, char eol) {
+    const char *nl = mem_rchr(start, eol, pos - start);
+    return nl ? nl + 1 : start;
+}
+
+// Start of the line after the one beginning at line, and the length of
+// that line without its terminator and trailing CRs.
+const char *line_next(const char *line, const char *end, char eol, size_t *len) {
+    const char *nl = memchr(line, eol, end - line);
+    const char *line_end = nl ? nl : end;
+    size_t n = line_end - line;
+    if (eol == '\n') {
+        while (n > 0 && line[n-1] == '\r') n--;
+    }
+    *len = n;
+    return nl ? nl + 1 : end;
+}
+
+// Multi-literal matching.  A LiteralSet is built once from the -F patterns
+// (or from the literals required by a regex) and finds occurrences of all
+// of them in a single pass: a plain substring search for one literal, a
+// Teddy-style SIMD fingerprint scan for small sets and an Aho-Corasick
+// automaton for everything else.  Occurrences are reported through a
+// callback, which returns nonzero to stop the scan.
+
+#define LITERAL_SINGLE 0
+#define LITERAL_TEDDY 1
+#define LITERAL_AHO_CORASICK 2
+
+#define TEDDY_MAX_PATTERNS 32
+#define TEDDY_BUCKETS 8
+
+typedef int (*OccurrenceFn)(void *ctx, const char *pos, size_t len, int id);
 
 typedef struct {
-    char *text;
-    int len;
-    int is_match;
-    int match_start;
-    int match_end;
-    size_t byte_offset;
-} Line;
+    int first_child;
+    int num_children;
+    int fail;
+    int out;
+    int dict;
+} AcNode;
 
 typedef struct {
+    int kind;
     int ignore_case;
-    int invert_match;
-    int line_number;
-    int list_files;
+    const char **pats;
+    size_t *lens;
     int count;
-    int no_filename;
-    int with_filename;
-    int recursive;
-    char *patterns[MAX_PATTERNS];
-    int num_patterns;
-    char *pattern_file;
-    int pattern_type; // 0 basic, 1 extended, 2 fixed, 3 perl
-    int word_regexp;
-    int line_regexp;
-    int null_data;
-    int no_messages;
-    int max_count;
-    int byte_offset;
-    int line_buffered;
-    char *label;
-    int only_matching;
-    int quiet;
-    int binary_files_type; // 0 binary, 1 text, 2 without-match
-    int directories_action; // 0 read, 1 recurse, 2 skip
-    int devices_action; // 0 read, 1 skip
-    int dereference_recursive;
-    char *include_glob;
-    char *exclude_glob;
-    char *exclude_from;
-    char *exclude_dir;
-    int files_without_match;
-    int initial_tab;
-    int null_output;
-    int before_context;
-    int after_context;
-    int context;
-    char *group_separator;
-    int no_group_separator;
-    int color;
-    int binary_option;
-    int color_when; // 0 never, 1 always, 2 auto
-    pcre2_code *code;
-} Options;
+    size_t max_len;
+    // Teddy: per fingerprint byte, bucket masks indexed by low and high nibble.
+    unsigned char teddy_lo[3][16];
+    unsigned char teddy_hi[3][16];
+    int teddy_len;
+    int *buckets[TEDDY_BUCKETS];
+    int bucket_count[TEDDY_BUCKETS];
+    // Aho-Corasick: nodes in breadth-first order, so the children of a node
+    // are contiguous and edge_byte[child] is sorted among siblings.
+    AcNode *nodes;
+    unsigned char *edge_byte;
+    int num_nodes;
+    int root_next[256];
+} LiteralSet;
 
-void print_usage() {
-    printf("Usage: grep [OPTION]... PATTERNS [FILE]...\n");
-    printf("Search for PATTERNS in each FILE.\n");
-    printf("Example: grep -i 'hello world' menu.h main.c\n");
-    printf("PATTERNS can contain multiple patterns separated by newlines.\n");
-    printf("\n");
-    printf("Pattern selection and interpretation:\n");
-    printf("  -E, --extended-regexp     PATTERNS are extended regular expressions\n");
-    printf("  -F, --fixed-strings       PATTERNS are strings\n");
-    printf("  -G, --basic-regexp        PATTERNS are basic regular expressions\n");
-    printf("  -P, --perl-regexp         PATTERNS are Perl regular expressions\n");
-    printf("  -e, --regexp=PATTERNS     use PATTERNS for matching\n");
-    printf("  -f, --file=FILE           take PATTERNS from FILE\n");
-    printf("  -i, --ignore-case         ignore case distinctions in patterns and data\n");
-    printf("      --no-ignore-case      do not ignore case distinctions (default)\n");
-    printf("  -w, --word-regexp         match only whole words\n");
-    printf("  -x, --line-regexp         match only whole lines\n");
-    printf("  -z, --null-data           a data line ends in 0 byte, not newline\n");
-    printf("\n");
-    printf("Miscellaneous:\n");
-    printf("  -s, --no-messages         suppress error messages\n");
-    printf("  -v, --invert-match        select non-matching lines\n");
-    printf("  -V, --version             display version information and exit\n");
-    printf("      --help                display this help text and exit\n");
-    printf("\n");
-    printf("Output control:\n");
-    printf("  -m, --max-count=NUM       stop after NUM selected lines\n");
-    printf("  -b, --byte-offset         print the byte offset with output lines\n");
-    printf("  -n, --line-number         print line number with output lines\n");
-    printf("      --line-buffered       flush output on every line\n");
-    printf("  -H, --with-filename       print file name with output lines\n");
-    printf("  -h, --no-filename         suppress the file name prefix on output\n");
-    printf("      --label=LABEL         use LABEL as the standard input file name prefix\n");
-    printf("  -o, --only-matching       show only nonempty parts of lines that match\n");
-    printf("  -q, --quiet, --silent     suppress all normal output\n");
-    printf("      --binary-files=TYPE   assume that binary files are TYPE;\n");
-    printf("                            TYPE is 'binary', 'text', or 'without-match'\n");
-    printf("  -a, --text                equivalent to --binary-files=text\n");
-    printf("  -I                        equivalent to --binary-files=without-match\n");
-    printf("  -d, --directories=ACTION  how to handle directories;\n");
-    printf("                            ACTION is 'read', 'recurse', or 'skip'\n");
-    printf("  -D, --devices=ACTION      how to handle devices, FIFOs and sockets;\n");
-    printf("                            ACTION is 'read' or 'skip'\n");
-    printf("  -r, --recursive           like --directories=recurse\n");
-    printf("  -R, --dereference-recursive  likewise, but follow all symlinks\n");
-    printf("      --include=GLOB        search only files that match GLOB (a file pattern)\n");
-    printf("      --exclude=GLOB        skip files that match GLOB\n");
-    printf("      --exclude-from=FILE   skip files that match any file pattern from FILE\n");
-    printf("      --exclude-dir=GLOB    skip directories that match GLOB\n");
-    printf("  -L, --files-without-match  print only names of FILEs with no selected lines\n");
-    printf("  -l, --files-with-matches  print only names of FILEs with selected lines\n");
-    printf("  -c, --count               print only a count of selected lines per FILE\n");
-    printf("  -T, --initial-tab         make tabs line up (if needed)\n");
-    printf("  -Z, --null                print 0 byte after FILE name\n");
-    printf("\n");
-    printf("Context control:\n");
-    printf("  -B, --before-context=NUM  print NUM lines of leading context\n");
-    printf("  -A, --after-context=NUM   print NUM lines of trailing context\n");
-    printf("  -C, --context=NUM         print NUM lines of output context\n");
-    printf("  -NUM                      same as --context=NUM\n");
-    printf("      --group-separator=SEP  print SEP on line between matches with context\n");
-    printf("      --no-group-separator  do not print separator for matches with context\n");
-    printf("      --color[=WHEN],\n");
-    printf("      --colour[=WHEN]       use markers to highlight the matching strings;\n");
-    printf("                            WHEN is 'always', 'never', or 'auto'\n");
-    printf("  -U, --binary              do not strip CR characters at EOL (MSDOS/Windows)\n");
-    printf("\n");
-    printf("When FILE is '-', read standard input.  With no FILE, read '.' if\n");
-    printf("recursive, '-' otherwise.  With fewer than two FILEs, assume -h.\n");
-    printf("Exit status is 0 if any line is selected, 1 otherwise;\n");
-    printf("if any error occurs and -q is not given, the exit status is 2.\n");
-    printf("\n");
-    printf("Report bugs to: bug-grep@gnu.org\n");
-    printf("GNU grep home page: <https://www.gnu.org/software/grep/>\n");
-    printf("General help using GNU software: <https://www.gnu.org/gethelp/>\n");
+int ac_child(LiteralSet *ls, int node, unsigned char b) {
+    int lo = ls->nodes[node].first_child;
+    int hi = lo + ls->nodes[node].num_children;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ls->edge_byte[mid] < b) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < ls->nodes[node].first_child + ls->nodes[node].num_children && ls->edge_byte[lo] == b ? lo : -1;
 }
 
-int parse_options(int argc, char *argv[], Options *opts, int *argi) {
-    opts->ignore_case = 0;
-    opts->invert_match = 0;
-    opts->line_number = 0;
-    opts->list_files = 0;
-    opts->count = 0;
-    opts->no_filename = 0;
-    opts->with_filename = 0;
-    opts->recursive = 0;
-    opts->num_patterns = 0;
-    opts->pattern_file = NULL;
-    opts->pattern_type = 0; // basic
-    opts->word_regexp = 0;
-    opts->line_regexp = 0;
-    opts->null_data = 0;
-    opts->no_messages = 0;
-    opts->max_count = -1;
-    opts->byte_offset = 0;
-    opts->line_buffered = 0;
-    opts->label = NULL;
-    opts->only_matching = 0;
-    opts->quiet = 0;
-    opts->binary_files_type = 0; // binary
-    opts->directories_action = 0; // read
-    opts->devices_action = 0; // read
-    opts->dereference_recursive = 0;
-    opts->include_glob = NULL;
-    opts->exclude_glob = NULL;
-    opts->exclude_from = NULL;
-    opts->exclude_dir = NULL;
-    opts->files_without_match = 0;
-    opts->initial_tab = 0;
-    opts->null_output = 0;
-    opts->before_context = 0;
-    opts->after_context = 0;
-    opts->context = 0;
-    opts->group_separator = "--";
-    opts->no_group_separator = 0;
-    opts->color = 0;
-    opts->binary_option = 0;
-    opts->color_when = 2; // auto
-    opts->code = NULL;
+LiteralSet *sort_set;
 
-    int i = *argi;
-    while (i < argc) {
-        if (argv[i][0] == '-') {
-            if (strcmp(argv[i], "-i") == 0) {
-                opts->ignore_case = 1;
-            } else if (strcmp(argv[i], "-v") == 0) {
-                opts->invert_match = 1;
-            } else if (strcmp(argv[i], "-n") == 0) {
-                opts->line_number = 1;
-            } else if (strcmp(argv[i], "-l") == 0) {
-                opts->list_files = 1;
-            } else if (strcmp(argv[i], "-c") == 0) {
-                opts->count = 1;
-            } else if (strcmp(argv[i], "-h") == 0) {
-                opts->no_filename = 1;
-            } else if (strcmp(argv[i], "-H") == 0) {
-                opts->with_filename = 1;
-            } else if (strcmp(argv[i], "-r") == 0) {
-                opts->recursive = 1;
-            } else if (strcmp(argv[i], "-e") == 0) {
-                i++;
-                if (i >= argc) {
-                    fprintf(stderr, "grep: option requires an argument -- 'e'\n");
-                    return 1;
+int compare_literals(const void *a, const void *b) {
+    int i = *(const int *)a, j = *(const int *)b;
+    size_t li = sort_set->lens[i], lj = sort_set->lens[j];
+    size_t n = li < lj ? li : lj;
+    for (size_t k = 0; k < n; k++) {
+        unsigned char ci = (unsigned char)sort_set->pats[i][k];
+        unsigned char cj = (unsigned char)sort_set->pats[j][k];
+        if (sort_set->ignore_case) {
+            ci = fold_table[ci];
+            cj = fold_table[cj];
+        }
+        if (ci != cj) return ci < cj ? -1 : 1;
+    }
+    if (li != lj) return li < lj ? -1 : 1;
+    return i < j ? -1 : i > j;
+}
+
+void ac_build(LiteralSet *ls) {
+    int n = ls->count;
+    int *order = malloc((n ? n : 1) * sizeof(int));
+    for (int i = 0; i < n; i++) order[i] = i;
+    sort_set = ls;
+    qsort(order, n, sizeof(int), compare_literals);
+
+    // Each node covers the range of sorted literals sharing its prefix, so
+    // the trie can be built level by level without per-node child tables.
+    int cap = 1024;
+    ls->nodes = malloc(cap * sizeof(AcNode));
+    ls->edge_byte = malloc(cap);
+    int *range_lo = malloc(cap * sizeof(int));
+    int *range_hi = malloc(cap * sizeof(int));
+    int *depth = malloc(cap * sizeof(int));
+    ls->num_nodes = 1;
+    range_lo[0] = 0;
+    range_hi[0] = n;
+    depth[0] = 0;
+    for (int u = 0; u < ls->num_nodes; u++) {
+        int lo = range_lo[u], hi = range_hi[u], d = depth[u];
+        AcNode *node = &ls->nodes[u];
+        node->out = -1;
+        node->dict = -1;
+        node->fail = 0;
+        while (lo < hi && ls->lens[order[lo]] == (size_t)d) {
+            if (node->out < 0) node->out = order[lo];
+            lo++;
+        }
+        node->first_child = ls->num_nodes;
+        node->num_children = 0;
+        while (lo < hi) {
+            unsigned char b = (unsigned char)ls->pats[order[lo]][d];
+            if (ls->ignore_case) b = fold_table[b];
+            int end = lo + 1;
+            while (end < hi) {
+                unsigned char c = (unsigned char)ls->pats[order[end]][d];
+                if (ls->ignore_case) c = fold_table[c];
+                if (c != b) break;
+                end++;
+            }
+            if (ls->num_nodes == cap) {
+                cap *= 2;
+                ls->nodes = realloc(ls->nodes, cap * sizeof(AcNode));
+                ls->edge_byte = realloc(ls->edge_byte, cap);
+                range_lo = realloc(range_lo, cap * sizeof(int));
+                range_hi = realloc(range_hi, cap * sizeof(int));
+                depth = realloc(depth, cap * sizeof(int));
+                node = &ls->nodes[u];
+            }
+            int child = ls->num_nodes++;
+            ls->edge_byte[child] = b;
+            range_lo[child] = lo;
+            range_hi[child] = end;
+            depth[child] = d + 1;
+            node->num_children++;
+            lo = end;
+        }
+    }
+    free(range_lo);
+    free(range_hi);
+    free(depth);
+    free(order);
+
+    for (int b = 0; b < 256; b++) ls->root_next[b] = 0;
+    for (int c = ls->nodes[0].first_child; c < ls->nodes[0].first_child + ls->nodes[0].num_children; c++) {
+        ls->root_next[ls->edge_byte[c]] = c;
+    }
+    // Breadth-first order means a node's fail target is always finished
+    // before the node itself.
+    for (int u = 0; u < ls->num_nodes; u++) {
+        AcNode *node = &ls->nodes[u];
+        for (int c = node->first_child; c < node->first_child + node->num_children; c++) {
+            int f = node->fail;
+            int t = -1;
+            if (u != 0) {
+                while ((t = f ? ac_child(ls, f, ls->edge_byte[c]) : ls->root_next[ls->edge_byte[c]]) <= 0 && f != 0) {
+                    f = ls->nodes[f].fail;
+                }
+            }
+            AcNode *child = &ls->nodes[c];
+            child->fail = t > 0 ? t : 0;
+            AcNode *fail = &ls->nodes[child->fail];
+            child->dict = fail->out >= 0 ? child->fail : fail->dict;
+        }
+    }
+}
+
+int ac_scan(LiteralSet *ls, const char *start, const char *end, OccurrenceFn fn, void *ctx) {
+    const unsigned char *p = (const unsigned char *)start;
+    const unsigned char *e = (const unsigned char *)end;
+    AcNode *nodes = ls->nodes;
+    int s = 0;
+    if (nodes[0].out >= 0 && fn(ctx, start, 0, nodes[0].out)) return 1;
+    while (p < e) {
+        if (s == 0 && nodes[0].out < 0) {
+            // Nothing in progress: skip bytes that cannot start a literal.
+            while (p < e && ls->root_next[ls->ignore_case ? fold_table[*p] : *p] == 0) p++;
+            if (p == e) break;
+        }
+        unsigned char b = ls->ignore_case ? fold_table[*p] : *p;
+        p++;
+        int t;
+        while (s != 0 && (t = ac_child(ls, s, b)) < 0) s = nodes[s].fail;
+        s = s ? t : ls->root_next[b];
+        for (int o = nodes[s].out >= 0 ? s : nodes[s].dict; o >= 0; o = nodes[o].dict) {
+            int id = nodes[o].out;
+            if (fn(ctx, (const char *)p - ls->lens[id], ls->lens[id], id)) return 1;
+            if (o == 0) break;
+        }
+    }
+    return 0;
+}
+
+int literal_at(LiteralSet *ls, int id, const char *pos, const char *end) {
+    size_t len = ls->lens[id];
+    if ((size_t)(end - pos) < len) return 0;
+    return ls->ignore_case ? mem_equal_icase(pos, ls->pats[id], len) : memcmp(pos, ls->pats[id], len) == 0;
+}
+
+int teddy_verify(LiteralSet *ls, const char *pos, const char *end, unsigned buckets, OccurrenceFn fn, void *ctx) {
+    while (buckets) {
+        int b = __builtin_ctz(buckets);
+        buckets &= buckets - 1;
+        for (int i = 0; i < ls->bucket_count[b]; i++) {
+            int id = ls->buckets[b][i];
+            if (literal_at(ls, id, pos, end) && fn(ctx, pos, ls->lens[id], id)) return 1;
+        }
+    }
+    return 0;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("ssse3")))
+int teddy_scan(LiteralSet *ls, const char *start, const char *end, OccurrenceFn fn, void *ctx) {
+    const __m128i low4 = _mm_set1_epi8(0x0F);
+    __m128i lo[3], hi[3];
+    int m = ls->teddy_len;
+    for (int j = 0; j < m; j++) {
+        lo[j] = _mm_loadu_si128((const __m128i *)ls->teddy_lo[j]);
+        hi[j] = _mm_loadu_si128((const __m128i *)ls->teddy_hi[j]);
+    }
+    const char *p = start;
+    while (end - p >= 16 + m - 1) {
+        __m128i res = _mm_set1_epi8((char)0xFF);
+        for (int j = 0; j < m; j++) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + j));
+            __m128i l = _mm_shuffle_epi8(lo[j], _mm_and_si128(v, low4));
+            __m128i h = _mm_shuffle_epi8(hi[j], _mm_and_si128(_mm_srli_epi16(v, 4), low4));
+            res = _mm_and_si128(res, _mm_and_si128(l, h));
+        }
+        unsigned mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(res, _mm_setzero_si128())) & 0xFFFF;
+        if (mask) {
+            unsigned char lanes[16];
+            _mm_storeu_si128((__m128i *)lanes, res);
+            while (mask) {
+                int k = __builtin_ctz(mask);
+                mask &= mask - 1;
+                if (teddy_verify(ls, p + k, end, lanes[k], fn, ctx)) return 1;
+            }
+        }
+        p += 16;
+    }
+    for (; end - p >= m; p++) {
+        unsigned buckets = 0xFF;
+        for (int j = 0; j < m; j++) {
+            unsigned char c = (unsigned char)p[j];
+            buckets &= ls->teddy_lo[j][c & 15] & ls->teddy_hi[j][c >> 4];
+        }
+        if (buckets && teddy_verify(ls, p, end, buckets, fn, ctx)) return 1;
+    }
+    return 0;
+}
+#endif
+
+void teddy_build(LiteralSet *ls, size_t min_len) {
+    ls->teddy_len = min_len < 3 ? (int)min_len : 3;
+    for (int i = 0; i < ls->count; i++) {
+        int b = i % TEDDY_BUCKETS;
+        ls->buckets[b] = realloc(ls->buckets[b], (ls->bucket_count[b] + 1) * sizeof(int));
+        ls->buckets[b][ls->bucket_count[b]++] = i;
+        for (int j = 0; j < ls->teddy_len; j++) {
+            unsigned char c = (unsigned char)ls->pats[i][j];
+            unsigned char variants[2] = { c, c };
+            if (ls->ignore_case) {
+                variants[0] = (unsigned char)tolower(c);
+                variants[1] = (unsigned char)toupper(c);
+            }
+            for (int v = 0; v < 2; v++) {
+                ls->teddy_lo[j][variants[v] & 15] |= 1 << b;
+                ls->teddy_hi[j][variants[v] >> 4] |= 1 << b;
+            }
+        }
+    }
+}
+
+LiteralSet *literal_set_new(const char **pats, size_t *lens, int count, int ignore_case) {
+    LiteralSet *ls = calloc(1, sizeof(LiteralSet));
+    ls->pats = pats;
+    ls->lens = lens;
+    ls->count = count;
+    ls->ignore_case = ignore_case;
+    size_t min_len = count ? (size_t)-1 : 0;
+    for (int i = 0; i < count; i++) {
+        if (lens[i] < min_len) min_len = lens[i];
+        if (lens[i] > ls->max_len) ls->max_len = lens[i];
+    }
+    if (count == 1) {
+        ls->kind = LITERAL_SINGLE;
+    } else if (count >= 2 && count <= TEDDY_MAX_PATTERNS && min_len > 0 && cpu_has_ssse3()) {
+        ls->kind = LITERAL_TEDDY;
+        teddy_build(ls, min_len);
+    } else {
+        ls->kind = LITERAL_AHO_CORASICK;
+        ac_build(ls);
+    }
+    return ls;
+}
+
+// Report occurrences in [start, end) in order of their start (single,
+// Teddy) or their end (Aho-Corasick).
+int literal_set_scan(LiteralSet *ls, const char *start, const char *end, OccurrenceFn fn, void *ctx) {
+    switch (ls->kind) {
+    case LITERAL_SINGLE: {
+        const char *pos = start;
+        while (pos <= end) {
+            pos = find_fixed(pos, end - pos, ls->pats[0], ls->lens[0], ls->ignore_case);
+            if (!pos) return 0;
+            if (fn(ctx, pos, ls->lens[0], 0)) return 1;
+            pos++;
+        }
+        return 0;
+    }
+#ifdef HAVE_X86_SIMD
+    case LITERAL_TEDDY:
+        return teddy_scan(ls, start, end, fn, ctx);
+#endif
+    default:
+        return ac_scan(ls, start, end, fn, ctx);
+    }
+}
+
+// POSIX basic and extended regular expressions (-G and -E).  Patterns are
+// parsed into a syntax tree and compiled into a Thompson NFA over the 256
+// byte values plus two pseudo-symbols for the line boundaries, so ^ and $
+// are ordinary transitions.  The NFA runs as a DFA whose states are built
+// lazily from sets of NFA states; the state cache is bounded and is flushed
+// when full, so a search costs time linear in the input whatever the
+// pattern.  Backreferences and word assertions are not regular; patterns
+// that use them are translated to pcre2 syntax instead.
+
+#define SYM_BOL 256
+#define SYM_EOL 257
+#define SYM_COUNT 258
+
+#define RX_DUP_MAX 32767
+#define RX_MAX_NODES 1000000
+
+typedef struct {
+    uint32_t bits[(SYM_COUNT + 31) / 32];
+} SymbolSet;
+
+void symset_add(SymbolSet *s, int sym) {
+    s->bits[sym >> 5] |= 1u << (sym & 31);
+}
+
+void symset_add_range(SymbolSet *s, int lo, int hi) {
+    for (int c = lo; c <= hi; c++) symset_add(s, c);
+}
+
+int symset_has(const SymbolSet *s, int sym) {
+    return (s->bits[sym >> 5] >> (sym & 31)) & 1;
+}
+
+#define RX_SET 0
+#define RX_CAT 1
+#define RX_ALT 2
+#define RX_STAR 3
+#define RX_PLUS 4
+#define RX_QUEST 5
+#define RX_EMPTY 6
+#define RX_OPAQUE 7 // backreference or word assertion; only pcre2 runs these
+
+typedef struct RxNode {
+    int type;
+    struct RxNode *left;
+    struct RxNode *right;
+    SymbolSet set;
+} RxNode;
+
+typedef struct {
+    RxNode **items;
+    int n;
+    int cap;
+} RxList;
+
+void rx_list_push(RxList *l, RxNode *node) {
+    if (l->n == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 16;
+        l->items = realloc(l->items, l->cap * sizeof(RxNode *));
+    }
+    l->items[l->n++] = node;
+}
+
+// Parser state.  Every construct is also written to pcre in pcre2 syntax,
+// which is what runs when the pattern needs more than an automaton.
+typedef struct {
+    const char *p;
+    const char *end;
+    int extended;
+    int icase;
+    int groups;       // capture groups opened in this pattern
+    int closed;       // and closed, for backreference checks
+    int group_base;   // groups of the earlier patterns
+    int needs_pcre;
+    int nodes;
+    const char *error;
+    char *pcre;
+    size_t pcre_len;
+    size_t pcre_cap;
+} RxParser;
+
+void rx_emit(RxParser *rp, const char *s, size_t n) {
+    if (rp->pcre_len + n + 1 > rp->pcre_cap) {
+        rp->pcre_cap = (rp->pcre_len + n + 1) * 2;
+        rp->pcre = realloc(rp->pcre, rp->pcre_cap);
+    }
+    memcpy(rp->pcre + rp->pcre_len, s, n);
+    rp->pcre_len += n;
+    rp->pcre[rp->pcre_len] = '\0';
+}
+
+void rx_emit_str(RxParser *rp, const char *s) {
+    rx_emit(rp, s, strlen(s));
+}
+
+// Insert s at offset at, used to group an atom that gets a second quantifier.
+void rx_emit_insert(RxParser *rp, size_t at, const char *s) {
+    size_t n = strlen(s);
+    rx_emit(rp, s, n);
+    memmove(rp->pcre + at + n, rp->pcre + at, rp->pcre_len - n - at);
+    memcpy(rp->pcre + at, s, n);
+}
+
+// Write one byte of a literal character, escaped where pcre2 would read it
+// as syntax (inside a bracket when in_class is set).
+void rx_emit_literal(RxParser *rp, unsigned char c, int in_class) {
+    const char *special = in_class ? "\\]^-[" : "\\^$.|?*+()[]{}";
+    if (c && c < 0x80 && strchr(special, c)) rx_emit(rp, "\\", 1);
+    rx_emit(rp, (const char *)&c, 1);
+}
+
+RxNode *rx_node(RxParser *rp, int type, RxNode *left, RxNode *right) {
+    RxNode *node = calloc(1, sizeof(RxNode));
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    rp->nodes++;
+    return node;
+}
+
+RxNode *rx_cat(RxParser *rp, RxNode *a, RxNode *b) {
+    if (!a || !b) return a ? a : b;
+    return rx_node(rp, RX_CAT, a, b);
+}
+
+RxNode *rx_alt(RxParser *rp, RxNode *a, RxNode *b) {
+    return a ? rx_node(rp, RX_ALT, a, b) : b;
+}
+
+RxNode *rx_set(RxParser *rp, const SymbolSet *set) {
+    RxNode *node = rx_node(rp, RX_SET, NULL, NULL);
+    node->set = *set;
+    return node;
+}
+
+RxNode *rx_symbol(RxParser *rp, int sym) {
+    SymbolSet set = {{0}};
+    symset_add(&set, sym);
+    return rx_set(rp, &set);
+}
+
+// Add byte c to a set, with its other case under -i.
+void rx_add_char(RxParser *rp, SymbolSet *set, int c) {
+    symset_add(set, c);
+    if (rp->icase && c < 0x80 && isalpha(c)) {
+        symset_add(set, tolower(c));
+        symset_add(set, toupper(c));
+    }
+}
+
+// Length of the UTF-8 character at p, or 1 for an invalid sequence.
+size_t utf8_char_len(const char *p, const char *end) {
+    unsigned char c = *p;
+    size_t n = c >= 0xF0 && c <= 0xF4 ? 4 : c >= 0xE0 ? 3 : c >= 0xC2 && c < 0xE0 ? 2 : 1;
+    if (c >= 0xF5 || (size_t)(end - p) < n) return 1;
+    for (size_t i = 1; i < n; i++) {
+        if (((unsigned char)p[i] & 0xC0) != 0x80) return 1;
+    }
+    return n;
+}
+
+// A literal character, which may be several bytes long.
+RxNode *rx_char(RxParser *rp, const char *p, size_t n) {
+    RxNode *node = NULL;
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = p[i];
+        // Case folding beyond ASCII is left to pcre2.
+        if (rp->icase && c >= 0x80) rp->needs_pcre = 1;
+        SymbolSet set = {{0}};
+        rx_add_char(rp, &set, c);
+        node = rx_cat(rp, node, rx_set(rp, &set));
+    }
+    return node;
+}
+
+// Any multibyte UTF-8 character: the well-formed sequences of 2 to 4 bytes.
+RxNode *rx_any_multibyte(RxParser *rp) {
+    static const unsigned char seqs[][5] = {
+        // lead byte range, second byte range, number of bytes
+        { 0xC2, 0xDF, 0x80, 0xBF, 2 },
+        { 0xE0, 0xE0, 0xA0, 0xBF, 3 },
+        { 0xE1, 0xEC, 0x80, 0xBF, 3 },
+        { 0xED, 0xED, 0x80, 0x9F, 3 },
+        { 0xEE, 0xEF, 0x80, 0xBF, 3 },
+        { 0xF0, 0xF0, 0x90, 0xBF, 4 },
+        { 0xF1, 0xF3, 0x80, 0xBF, 4 },
+        { 0xF4, 0xF4, 0x80, 0x8F, 4 },
+    };
+    RxNode *any = NULL;
+    for (size_t i = 0; i < sizeof(seqs) / sizeof(seqs[0]); i++) {
+        SymbolSet lead = {{0}}, second = {{0}}, tail = {{0}};
+        symset_add_range(&lead, seqs[i][0], seqs[i][1]);
+        symset_add_range(&second, seqs[i][2], seqs[i][3]);
+        symset_add_range(&tail, 0x80, 0xBF);
+        RxNode *seq = rx_cat(rp, rx_set(rp, &lead), rx_set(rp, &second));
+        for (int j = 2; j < seqs[i][4]; j++) seq = rx_cat(rp, seq, rx_set(rp, &tail));
+        any = rx_alt(rp, any, seq);
+    }
+    return any;
+}
+
+// Any character outside the ASCII set excluded: the complement of excluded
+// within ASCII, or any multibyte character.
+RxNode *rx_any_except(RxParser *rp, const SymbolSet *excluded) {
+    SymbolSet set = {{0}};
+    for (int c = 0; c < 0x80; c++) {
+        if (!symset_has(excluded, c)) symset_add(&set, c);
+    }
+    return rx_alt(rp, rx_set(rp, &set), rx_any_multibyte(rp));
+}
+
+void rx_add_class(SymbolSet *set, int (*is_class)(int)) {
+    for (int c = 0; c < 0x80; c++) {
+        if (is_class(c)) symset_add(set, c);
+    }
+}
+
+int is_word_class(int c) {
+    return isalnum(c) || c == '_';
+}
+
+int is_space_class(int c) {
+    return isspace(c);
+}
+
+RxNode *rx_clone(RxParser *rp, RxNode *node) {
+    if (!node) return NULL;
+    RxNode *copy = rx_node(rp, node->type, rx_clone(rp, node->left), rx_clone(rp, node->right));
+    copy->set = node->set;
+    return copy;
+}
+
+// atom{min,max}, with max < 0 for no upper bound.  Copies are made so the
+// automaton stays a plain NFA; the optional copies are nested so that
+// x{0,n} adds n states rather than n squared.
+RxNode *rx_repeat(RxParser *rp, RxNode *atom, int min, int max) {
+    if (min == 0 && max < 0) return rx_node(rp, RX_STAR, atom, NULL);
+    if (min == 1 && max < 0) return rx_node(rp, RX_PLUS, atom, NULL);
+    if (min == 0 && max == 1) return rx_node(rp, RX_QUEST, atom, NULL);
+    if (max == 0) return rx_node(rp, RX_EMPTY, NULL, NULL);
+    RxNode *node = NULL;
+    for (int i = 0; i < min && rp->nodes < RX_MAX_NODES; i++) {
+        node = rx_cat(rp, node, i == 0 ? atom : rx_clone(rp, atom));
+    }
+    if (max < 0) {
+        node = rx_cat(rp, node, rx_node(rp, RX_STAR, rx_clone(rp, atom), NULL));
+    } else if (max > min) {
+        RxNode *optional = NULL;
+        for (int i = min; i < max && rp->nodes < RX_MAX_NODES; i++) {
+            RxNode *copy = i == 0 ? atom : rx_clone(rp, atom);
+            optional = rx_node(rp, RX_QUEST, rx_cat(rp, copy, optional), NULL);
+        }
+        node = rx_cat(rp, node, optional);
+    }
+    if (rp->nodes >= RX_MAX_NODES) rp->error = "Regular expression too big";
+    return node;
+}
+
+int rx_at_alternation(RxParser *rp) {
+    if (rp->extended) return rp->p < rp->end && *rp->p == '|';
+    return rp->p + 1 < rp->end && rp->p[0] == '\\' && rp->p[1] == '|';
+}
+
+int rx_at_close(RxParser *rp, int depth) {
+    if (depth == 0) return 0;
+    if (rp->extended) return rp->p < rp->end && *rp->p == ')';
+    return rp->p + 1 < rp->end && rp->p[0] == '\\' && rp->p[1] == ')';
+}
+
+RxNode *rx_parse_alternation(RxParser *rp, int depth);
+
+// Parse the interval after '{' (or "\{").  Returns 0 if it is not a valid
+// interval, leaving rp->p alone.
+int rx_parse_interval(RxParser *rp, int *min, int *max) {
+    const char *p = rp->p;
+    long lo = 0, hi = -1;
+    int have_lo = 0;
+    while (p < rp->end && isdigit((unsigned char)*p)) {
+        lo = lo * 10 + (*p++ - '0');
+        if (lo > RX_DUP_MAX + 1) lo = RX_DUP_MAX + 1;
+        have_lo = 1;
+    }
+    hi = lo;
+    if (p < rp->end && *p == ',') {
+        p++;
+        hi = -1;
+        if (p < rp->end && isdigit((unsigned char)*p)) {
+            hi = 0;
+            while (p < rp->end && isdigit((unsigned char)*p)) {
+                hi = hi * 10 + (*p++ - '0');
+                if (hi > RX_DUP_MAX + 1) hi = RX_DUP_MAX + 1;
+            }
+        }
+    } else if (!have_lo) {
+        return 0;
+    }
+    if (rp->extended) {
+        if (p >= rp->end || *p != '}') return 0;
+        p++;
+    } else {
+        if (p + 1 >= rp->end || p[0] != '\\' || p[1] != '}') return 0;
+        p += 2;
+    }
+    if (hi >= 0 && lo > hi) {
+        rp->error = "Invalid content of \\{\\}";
+        return 0;
+    }
+    if (lo > RX_DUP_MAX || hi > RX_DUP_MAX) {
+        rp->error = "Regular expression too big";
+        return 0;
+    }
+    rp->p = p;
+    *min = (int)lo;
+    *max = (int)hi;
+    return 1;
+}
+
+// Apply any quantifiers that follow an atom.  The atom's pcre2 text starts
+// at atom_at; it is grouped if a second quantifier follows, since stacked
+// quantifiers mean something else to pcre2.
+RxNode *rx_parse_quantifiers(RxParser *rp, RxNode *atom, size_t atom_at) {
+    int count = 0;
+    while (rp->p < rp->end && !rp->error) {
+        const char *p = rp->p;
+        int min, max;
+        if (*p == '*') {
+            min = 0, max = -1;
+            rp->p++;
+        } else if (rp->extended && (*p == '+' || *p == '?')) {
+            min = *p == '+', max = *p == '+' ? -1 : 1;
+            rp->p++;
+        } else if (!rp->extended && p + 1 < rp->end && p[0] == '\\' && (p[1] == '+' || p[1] == '?')) {
+            min = p[1] == '+', max = p[1] == '+' ? -1 : 1;
+            rp->p += 2;
+        } else if (rp->extended && *p == '{') {
+            rp->p++;
+            if (!rx_parse_interval(rp, &min, &max)) {
+                // Not an interval: the brace is an ordinary character.
+                rp->p = p;
+                break;
+            }
+        } else if (!rp->extended && p + 1 < rp->end && p[0] == '\\' && p[1] == '{') {
+            rp->p += 2;
+            if (!rx_parse_interval(rp, &min, &max)) {
+                if (!rp->error) rp->error = "Unmatched \\{";
+                break;
+            }
+        } else {
+            break;
+        }
+        if (count++ > 0) {
+            rx_emit_insert(rp, atom_at, "(?:");
+            rx_emit_str(rp, ")");
+        }
+        char buf[32];
+        if (max < 0) {
+            sprintf(buf, "{%d,}", min);
+        } else if (min == max) {
+            sprintf(buf, "{%d}", min);
+        } else {
+            sprintf(buf, "{%d,%d}", min, max);
+        }
+        rx_emit_str(rp, buf);
+        atom = rx_repeat(rp, atom, min, max);
+    }
+    return atom;
+}
+
+// Read one bracket element: a character, [.c.] or [=c=].  Sets *c to its
+// first byte and returns its length in bytes, or 0 on error.
+size_t rx_bracket_char(RxParser *rp, const char **start) {
+    const char *p = rp->p;
+    if (p + 1 < rp->end && p[0] == '[' && (p[1] == '.' || p[1] == '=')) {
+        char kind = p[1];
+        const char *q = p + 2;
+        while (q + 1 < rp->end && !(q[0] == kind && q[1] == ']')) q++;
+        if (q + 1 >= rp->end) {
+            rp->error = "Unmatched [, [^, [:, [., or [=";
+            return 0;
+        }
+        size_t n = utf8_char_len(p + 2, q);
+        if (q == p + 2 || p + 2 + n != q) {
+            rp->error = "Invalid collation character";
+            return 0;
+        }
+        *start = p + 2;
+        rp->p = q + 2;
+        return n;
+    }
+    size_t n = utf8_char_len(p, rp->end);
+    *start = p;
+    rp->p = p + n;
+    return n;
+}
+
+// Parse a bracket expression; rp->p is just past the '['.
+RxNode *rx_parse_bracket(RxParser *rp) {
+    static const struct { const char *name; int (*fn)(int); } classes[] = {
+        { "alpha", isalpha }, { "upper", isupper }, { "lower", islower },
+        { "digit", isdigit }, { "xdigit", isxdigit }, { "space", isspace },
+        { "blank", isblank }, { "punct", ispunct }, { "print", isprint },
+        { "graph", isgraph }, { "cntrl", iscntrl }, { "alnum", isalnum },
+    };
+    const char *open = rp->p;
+    int negate = rp->p < rp->end && *rp->p == '^';
+    if (negate) rp->p++;
+    SymbolSet set = {{0}};
+    RxNode *multibyte = NULL;
+    rx_emit_str(rp, negate ? "[^" : "[");
+    int first = 1;
+    while (1) {
+        if (rp->p >= rp->end) {
+            rp->error = "Unmatched [, [^, [:, [., or [=";
+            return NULL;
+        }
+        if (*rp->p == ']' && !first) {
+            rp->p++;
+            break;
+        }
+        first = 0;
+        if (rp->p + 1 < rp->end && rp->p[0] == '[' && rp->p[1] == ':') {
+            const char *name = rp->p + 2;
+            const char *q = name;
+            while (q + 1 < rp->end && !(q[0] == ':' && q[1] == ']')) q++;
+            if (q + 1 >= rp->end) {
+                rp->error = "Unmatched [, [^, [:, [., or [=";
+                return NULL;
+            }
+            size_t i;
+            for (i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+                if (strlen(classes[i].name) == (size_t)(q - name) && memcmp(classes[i].name, name, q - name) == 0) break;
+            }
+            if (i == sizeof(classes) / sizeof(classes[0])) {
+                rp->error = "Invalid character class name";
+                return NULL;
+            }
+            // Under -i, [:upper:] and [:lower:] both mean any letter.
+            int (*fn)(int) = classes[i].fn;
+            if (rp->icase && (fn == isupper || fn == islower)) fn = isalpha;
+            rx_add_class(&set, fn);
+            rx_emit(rp, rp->p, q + 2 - rp->p);
+            rp->p = q + 2;
+            continue;
+        }
+        const char *lo;
+        size_t lo_len = rx_bracket_char(rp, &lo);
+        if (!lo_len) return NULL;
+        if (rp->p + 1 < rp->end && rp->p[0] == '-' && rp->p[1] != ']') {
+            rp->p++;
+            const char *hi;
+            size_t hi_len = rx_bracket_char(rp, &hi);
+            if (!hi_len) return NULL;
+            for (size_t i = 0; i < lo_len; i++) rx_emit_literal(rp, lo[i], 1);
+            rx_emit(rp, "-", 1);
+            for (size_t i = 0; i < hi_len; i++) rx_emit_literal(rp, hi[i], 1);
+            if (lo_len > 1 || hi_len > 1) {
+                // Ranges of multibyte characters are left to pcre2.
+                rp->needs_pcre = 1;
+                continue;
+            }
+            if ((unsigned char)*lo > (unsigned char)*hi) {
+                rp->error = "Invalid range end";
+                return NULL;
+            }
+            for (int c = (unsigned char)*lo; c <= (unsigned char)*hi; c++) rx_add_char(rp, &set, c);
+            continue;
+        }
+        for (size_t i = 0; i < lo_len; i++) rx_emit_literal(rp, lo[i], 1);
+        if (lo_len > 1 || (unsigned char)*lo >= 0x80) {
+            if (negate || rp->icase) rp->needs_pcre = 1;
+            multibyte = rx_alt(rp, multibyte, rx_char(rp, lo, lo_len));
+        } else {
+            rx_add_char(rp, &set, (unsigned char)*lo);
+        }
+    }
+    rx_emit(rp, "]", 1);
+    // [:space:] where [[:space:]] was meant is almost certainly a mistake.
+    if (rp->p - open >= 4 && open[0] == ':' && rp->p[-2] == ':') {
+        rp->error = "character class syntax is [[:space:]], not [:space:]";
+        return NULL;
+    }
+    if (negate) return rx_any_except(rp, &set);
+    return rx_alt(rp, multibyte, rx_set(rp, &set));
+}
+
+// Parse one atom.  at_start is set at the start of a branch, the only
+// place a BRE ^ is an anchor.  Otherwise a quantifier character that
+// reaches here has nothing to repeat and is literal.
+RxNode *rx_parse_atom(RxParser *rp, int depth, int at_start, int *anchor) {
+    const char *p = rp->p;
+    unsigned char c = *p;
+    *anchor = 0;
+    if (rp->extended ? c == '(' : (c == '\\' && p + 1 < rp->end && p[1] == '(')) {
+        rp->p += rp->extended ? 1 : 2;
+        rp->groups++;
+        rx_emit(rp, "(", 1);
+        RxNode *inner = rx_parse_alternation(rp, depth + 1);
+        if (rp->error) return NULL;
+        if (!rx_at_close(rp, depth + 1)) {
+            rp->error = "Unmatched ( or \\(";
+            return NULL;
+        }
+        rp->p += rp->extended ? 1 : 2;
+        rp->closed++;
+        rx_emit(rp, ")", 1);
+        return inner;
+    }
+    int interval = 0;
+    if (rp->extended && at_start && c == '{') {
+        int min, max;
+        rp->p++;
+        interval = rx_parse_interval(rp, &min, &max);
+        rp->p = p;
+        if (rp->error) return NULL;
+    }
+    if (rp->extended && at_start && (c == '*' || c == '+' || c == '?' || interval)) {
+        // As in GNU grep, a leading ERE quantifier repeats the empty string.
+        if (c == '{') {
+            fprintf(stderr, "grep: warning: {...} at start of expression\n");
+        } else {
+            fprintf(stderr, "grep: warning: %c at start of expression\n", c);
+        }
+        rx_emit_str(rp, "(?:)");
+        return rx_node(rp, RX_EMPTY, NULL, NULL);
+    }
+    if (!rp->extended && c == '\\' && p + 1 < rp->end && p[1] == ')') {
+        rp->error = "Unmatched ) or \\)";
+        return NULL;
+    }
+    if (c == '^' && (rp->extended || at_start)) {
+        rp->p++;
+        *anchor = 1;
+        rx_emit(rp, "^", 1);
+        return rx_symbol(rp, SYM_BOL);
+    }
+    if (c == '$') {
+        const char *q = p + 1;
+        if (rp->extended || q == rp->end || (q + 1 < rp->end && q[0] == '\\' && (q[1] == ')' || q[1] == '|'))) {
+            rp->p++;
+            *anchor = 1;
+            rx_emit(rp, "$", 1);
+            return rx_symbol(rp, SYM_EOL);
+        }
+    }
+    if (c == '.') {
+        rp->p++;
+        rx_emit(rp, ".", 1);
+        SymbolSet none = {{0}};
+        return rx_any_except(rp, &none);
+    }
+    if (c == '[') {
+        rp->p++;
+        return rx_parse_bracket(rp);
+    }
+    if (c == '\\') {
+        if (p + 1 >= rp->end) {
+            rp->error = "Trailing backslash";
+            return NULL;
+        }
+        unsigned char e = p[1];
+        SymbolSet set = {{0}};
+        if (e >= '1' && e <= '9') {
+            if (e - '0' > rp->closed) {
+                rp->error = "Invalid back reference";
+                return NULL;
+            }
+            char buf[32];
+            sprintf(buf, "\\g{%d}", e - '0' + rp->group_base);
+            rx_emit_str(rp, buf);
+            rp->p += 2;
+            rp->needs_pcre = 1;
+            return rx_node(rp, RX_OPAQUE, NULL, NULL);
+        }
+        if (strchr("<>bB`'", e)) {
+            static const char *assertions[][2] = {
+                { "<", "\\b(?=\\w)" }, { ">", "\\b(?<=\\w)" }, { "b", "\\b" },
+                { "B", "\\B" }, { "`", "^" }, { "'", "$" },
+            };
+            for (size_t i = 0; i < sizeof(assertions) / sizeof(assertions[0]); i++) {
+                if (assertions[i][0][0] == e) rx_emit_str(rp, assertions[i][1]);
+            }
+            rp->p += 2;
+            rp->needs_pcre = 1;
+            return rx_node(rp, RX_OPAQUE, NULL, NULL);
+        }
+        if (strchr("wWsS", e)) {
+            char buf[3] = { '\\', e, '\0' };
+            rx_emit_str(rp, buf);
+            rp->p += 2;
+            rx_add_class(&set, tolower(e) == 'w' ? is_word_class : is_space_class);
+            if (islower(e)) return rx_set(rp, &set);
+            return rx_any_except(rp, &set);
+        }
+        // Any other escaped character stands for itself.
+        rp->p++;
+        p++;
+        c = e;
+    }
+    // Anything else, including a quantifier with nothing to repeat, is an
+    // ordinary character.
+    size_t n = utf8_char_len(p, rp->end);
+    for (size_t i = 0; i < n; i++) rx_emit_literal(rp, p[i], 0);
+    rp->p = p + n;
+    return rx_char(rp, p, n);
+}
+
+RxNode *rx_parse_branch(RxParser *rp, int depth) {
+    RxNode *node = NULL;
+    int at_start = 1;
+    while (rp->p < rp->end && !rx_at_alternation(rp) && !rx_at_close(rp, depth)) {
+        size_t atom_at = rp->pcre_len;
+        int anchor;
+        RxNode *atom = rx_parse_atom(rp, depth, at_start, &anchor);
+        if (rp->error) return NULL;
+        if (!anchor || rp->extended) atom = rx_parse_quantifiers(rp, atom, atom_at);
+        if (rp->error) return NULL;
+        node = rx_cat(rp, node, atom);
+        at_start = 0;
+    }
+    return node ? node : rx_node(rp, RX_EMPTY, NULL, NULL);
+}
+
+RxNode *rx_parse_alternation(RxParser *rp, int depth) {
+    RxNode *node = rx_parse_branch(rp, depth);
+    while (!rp->error && rx_at_alternation(rp)) {
+        rp->p += rp->extended ? 1 : 2;
+        rx_emit(rp, "|", 1);
+        node = rx_alt(rp, node, rx_parse_branch(rp, depth));
+    }
+    return node;
+}
+
+// Collect the operands of a chain of type nodes (concatenation or
+// alternation) in order.  Long patterns make long chains, so the chain
+// itself is walked without recursion.
+void rx_collect(RxNode *node, int type, RxList *out) {
+    RxList rights = {0};
+    while (node->type == type) {
+        rx_list_push(&rights, node->right);
+        node = node->left;
+    }
+    rx_list_push(out, node);
+    for (int i = rights.n - 1; i >= 0; i--) {
+        if (rights.items[i]->type == type) {
+            rx_collect(rights.items[i], type, out);
+        } else {
+            rx_list_push(out, rights.items[i]);
+        }
+    }
+    free(rights.items);
+}
+
+// NFA states.  A SET state consumes one symbol of its set; SPLIT has two
+// epsilon successors.
+#define NFA_SET 0
+#define NFA_SPLIT 1
+#define NFA_MATCH 2
+
+typedef struct {
+    int type;
+    int out;
+    int out1;
+    SymbolSet set;
+} NfaState;
+
+typedef struct {
+    NfaState *states;
+    int count;
+    int cap;
+    int start;
+} Nfa;
+
+int nfa_add(Nfa *nfa, int type, int out, int out1, const SymbolSet *set) {
+    if (nfa->count == nfa->cap) {
+        nfa->cap = nfa->cap ? nfa->cap * 2 : 64;
+        nfa->states = realloc(nfa->states, nfa->cap * sizeof(NfaState));
+    }
+    NfaState *s = &nfa->states[nfa->count];
+    s->type = type;
+    s->out = out;
+    s->out1 = out1;
+    if (set) s->set = *set;
+    return nfa->count++;
+}
+
+// Compile node so that it continues to state next; returns its entry
+// state.  With reverse set the automaton reads the text backwards.
+int nfa_compile(Nfa *nfa, RxNode *node, int next, int reverse) {
+    switch (node->type) {
+    case RX_SET:
+        return nfa_add(nfa, NFA_SET, next, -1, &node->set);
+    case RX_CAT: {
+        RxList items = {0};
+        rx_collect(node, RX_CAT, &items);
+        for (int i = 0; i < items.n; i++) {
+            next = nfa_compile(nfa, items.items[reverse ? i : items.n - 1 - i], next, reverse);
+        }
+        free(items.items);
+        return next;
+    }
+    case RX_ALT: {
+        RxList items = {0};
+        rx_collect(node, RX_ALT, &items);
+        int entry = nfa_compile(nfa, items.items[items.n - 1], next, reverse);
+        for (int i = items.n - 2; i >= 0; i--) {
+            int branch = nfa_compile(nfa, items.items[i], next, reverse);
+            entry = nfa_add(nfa, NFA_SPLIT, branch, entry, NULL);
+        }
+        free(items.items);
+        return entry;
+    }
+    case RX_STAR:
+    case RX_PLUS: {
+        int loop = nfa_add(nfa, NFA_SPLIT, -1, next, NULL);
+        int body = nfa_compile(nfa, node->left, loop, reverse);
+        nfa->states[loop].out = body;
+        return node->type == RX_STAR ? loop : body;
+    }
+    case RX_QUEST:
+        return nfa_add(nfa, NFA_SPLIT, nfa_compile(nfa, node->left, next, reverse), next, NULL);
+    default:
+        return next;
+    }
+}
+
+// Build the NFA for node.  An unanchored automaton may skip any prefix of
+// the input (any suffix when reversed) before the match.
+void nfa_build(Nfa *nfa, RxNode *node, int reverse, int unanchored) {
+    int match = nfa_add(nfa, NFA_MATCH, -1, -1, NULL);
+    nfa->start = nfa_compile(nfa, node, match, reverse);
+    if (unanchored) {
+        SymbolSet any = {{0}};
+        symset_add_range(&any, 0, 255);
+        symset_add(&any, reverse ? SYM_EOL : SYM_BOL);
+        int loop = nfa_add(nfa, NFA_SPLIT, nfa->start, -1, NULL);
+        nfa->states[loop].out1 = nfa_add(nfa, NFA_SET, loop, -1, &any);
+        nfa->start = loop;
+    }
+}
+
+// Lazily built DFA.  Each state is a sorted set of NFA states; transitions
+// are indexed by byte class, with BOL and EOL taking the two classes after
+// the bytes.  trans holds -1 for transitions not computed yet.  fast holds
+// the same transitions as offsets into trans for the buffer scan, with -1
+// wherever the scan has to look closer: unknown transitions, accepting
+// targets, and the line terminator and CR, which have classes of their own.
+// idle is the start state of an unanchored search when most bytes leave it
+// where it is; the scan skips those bytes with idle_stop instead of taking
+// one transition per byte.
+
+#define DFA_CACHE_BYTES (4 * 1024 * 1024)
+#define DFA_ACCEPT 1
+#define DFA_DEAD 2
+
+typedef struct {
+    Nfa nfa;
+    unsigned char byte_class[256];
+    int class_sym[SYM_COUNT];
+    int stride;
+    int bol;
+    int eol;
+    int *trans;
+    int *fast;
+    unsigned char special[SYM_COUNT];
+    unsigned char *flags;
+    int *set_offset;
+    int *set_len;
+    int *pool;
+    size_t pool_len;
+    size_t pool_cap;
+    int num_states;
+    int state_cap;
+    int max_states;
+    int *slots;
+    int slot_mask;
+    int start;
+    int idle;
+    unsigned idle_epoch;
+    unsigned char idle_stop[256];
+    unsigned flushes;
+    int *work;
+    int *stack;
+    unsigned *mark;
+    unsigned gen;
+} Dfa;
+
+// Partition the bytes into classes that no NFA state tells apart, keeping
+// eol and CR apart from everything else.
+void dfa_byte_classes(Dfa *d, char eol) {
+    memset(d->byte_class, 0, sizeof(d->byte_class));
+    d->byte_class[(unsigned char)eol] = 1;
+    d->byte_class['\r'] = 2;
+    int n = 3;
+    const SymbolSet *prev = NULL;
+    for (int i = 0; i < d->nfa.count; i++) {
+        const NfaState *s = &d->nfa.states[i];
+        if (s->type != NFA_SET || (prev && memcmp(prev->bits, s->set.bits, 32) == 0)) continue;
+        prev = &s->set;
+        int map[512];
+        memset(map, -1, sizeof(map));
+        int m = 0;
+        for (int b = 0; b < 256; b++) {
+            int key = d->byte_class[b] * 2 + symset_has(&s->set, b);
+            if (map[key] < 0) map[key] = m++;
+            d->byte_class[b] = map[key];
+        }
+        n = m;
+    }
+    for (int b = 255; b >= 0; b--) d->class_sym[d->byte_class[b]] = b;
+    d->bol = n;
+    d->eol = n + 1;
+    d->class_sym[d->bol] = SYM_BOL;
+    d->class_sym[d->eol] = SYM_EOL;
+    d->stride = n + 2;
+    d->special[d->byte_class[(unsigned char)eol]] = 1;
+    if (eol == '\n') d->special[d->byte_class['\r']] = 1;
+    d->special[d->bol] = 1;
+    d->special[d->eol] = 1;
+}
+
+// Allocate an empty state cache for d.
+void dfa_cache_init(Dfa *d) {
+    d->max_states = DFA_CACHE_BYTES / (d->stride * 2 * sizeof(int));
+    if (d->max_states < 64) d->max_states = 64;
+    d->slot_mask = 63;
+    d->slots = malloc((d->slot_mask + 1) * sizeof(int));
+    memset(d->slots, -1, (d->slot_mask + 1) * sizeof(int));
+    d->work = malloc(d->nfa.count * sizeof(int));
+    d->stack = malloc(d->nfa.count * sizeof(int));
+    d->mark = calloc(d->nfa.count, sizeof(unsigned));
+    d->start = -1;
+    d->idle = -1;
+}
+
+Dfa *dfa_new(RxNode *node, int reverse, int unanchored, char eol) {
+    Dfa *d = calloc(1, sizeof(Dfa));
+    nfa_build(&d->nfa, node, reverse, unanchored);
+    dfa_byte_classes(d, eol);
+    dfa_cache_init(d);
+    return d;
+}
+
+// A DFA for the same automaton with a cache of its own, for another
+// thread.  The NFA is only read, so the two share it.
+Dfa *dfa_clone(const Dfa *src) {
+    Dfa *d = calloc(1, sizeof(Dfa));
+    d->nfa = src->nfa;
+    memcpy(d->byte_class, src->byte_class, sizeof(d->byte_class));
+    memcpy(d->class_sym, src->class_sym, sizeof(d->class_sym));
+    memcpy(d->special, src->special, sizeof(d->special));
+    d->stride = src->stride;
+    d->bol = src->bol;
+    d->eol = src->eol;
+    dfa_cache_init(d);
+    return d;
+}
+
+// Add the epsilon closure of state id to d->work, keeping only the states
+// that consume a symbol or accept.
+void dfa_closure(Dfa *d, int id, int *n) {
+    int top = 0;
+    if (d->mark[id] == d->gen) return;
+    d->mark[id] = d->gen;
+    d->stack[top++] = id;
+    while (top > 0) {
+        const NfaState *s = &d->nfa.states[d->stack[--top]];
+        if (s->type == NFA_SPLIT) {
+            if (d->mark[s->out1] != d->gen) {
+                d->mark[s->out1] = d->gen;
+                d->stack[top++] = s->out1;
+            }
+            if (d->mark[s->out] != d->gen) {
+                d->mark[s->out] = d->gen;
+                d->stack[top++] = s->out;
+            }
+        } else {
+            d->work[(*n)++] = (int)(s - d->nfa.states);
+        }
+    }
+}
+
+int compare_ints(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return x < y ? -1 : x > y;
+}
+
+unsigned dfa_hash(const int *set, int n) {
+    unsigned h = 2166136261u;
+    for (int i = 0; i < n; i++) h = (h ^ (unsigned)set[i]) * 16777619u;
+    return h;
+}
+
+// Drop every cached state.  Callers must not hold on to state numbers
+// across a call that can flush; d->flushes counts the flushes.
+void dfa_flush(Dfa *d) {
+    d->num_states = 0;
+    d->pool_len = 0;
+    d->start = -1;
+    d->idle = -1;
+    d->flushes++;
+    memset(d->slots, -1, (d->slot_mask + 1) * sizeof(int));
+}
+
+// Find or add the state for the n NFA states in d->work.
+int dfa_state(Dfa *d, int n) {
+    if (n > 32) {
+        qsort(d->work, n, sizeof(int), compare_ints);
+    } else {
+        for (int i = 1; i < n; i++) {
+            int v = d->work[i], j = i;
+            for (; j > 0 && d->work[j - 1] > v; j--) d->work[j] = d->work[j - 1];
+            d->work[j] = v;
+        }
+    }
+    unsigned h = dfa_hash(d->work, n);
+    for (unsigned i = h & d->slot_mask; ; i = (i + 1) & d->slot_mask) {
+        int s = d->slots[i];
+        if (s < 0) break;
+        if (d->set_len[s] == n && memcmp(d->pool + d->set_offset[s], d->work, n * sizeof(int)) == 0) return s;
+    }
+    if (d->num_states == d->max_states || d->pool_len + n > (size_t)d->max_states * 64) {
+        dfa_flush(d);
+    }
+    int s = d->num_states++;
+    if (s == d->state_cap) {
+        int cap = s ? s * 2 : 16;
+        if (cap > d->max_states) cap = d->max_states;
+        d->state_cap = cap;
+        d->trans = realloc(d->trans, (size_t)cap * d->stride * sizeof(int));
+        d->fast = realloc(d->fast, (size_t)cap * d->stride * sizeof(int));
+        d->flags = realloc(d->flags, cap);
+        d->set_offset = realloc(d->set_offset, cap * sizeof(int));
+        d->set_len = realloc(d->set_len, cap * sizeof(int));
+        // Keep the hash table at most half full.
+        if (cap * 2 > d->slot_mask + 1) {
+            while (cap * 2 > d->slot_mask + 1) d->slot_mask = d->slot_mask * 2 + 1;
+            d->slots = realloc(d->slots, (d->slot_mask + 1) * sizeof(int));
+            memset(d->slots, -1, (d->slot_mask + 1) * sizeof(int));
+            for (int i = 0; i < s; i++) {
+                unsigned j = dfa_hash(d->pool + d->set_offset[i], d->set_len[i]) & d->slot_mask;
+                while (d->slots[j] >= 0) j = (j + 1) & d->slot_mask;
+                d->slots[j] = i;
+            }
+        }
+    }
+    if (d->pool_len + n > d->pool_cap) {
+        d->pool_cap = (d->pool_len + n) * 2;
+        d->pool = realloc(d->pool, d->pool_cap * sizeof(int));
+    }
+    memcpy(d->pool + d->pool_len, d->work, n * sizeof(int));
+    d->set_offset[s] = (int)d->pool_len;
+    d->set_len[s] = n;
+    d->pool_len += n;
+    memset(d->trans + (size_t)s * d->stride, -1, d->stride * sizeof(int));
+    memset(d->fast + (size_t)s * d->stride, -1, d->stride * sizeof(int));
+    d->flags[s] = n == 0 ? DFA_DEAD : 0;
+    for (int i = 0; i < n; i++) {
+        if (d->nfa.states[d->work[i]].type == NFA_MATCH) d->flags[s] |= DFA_ACCEPT;
+    }
+    for (unsigned i = dfa_hash(d->work, n) & d->slot_mask; ; i = (i + 1) & d->slot_mask) {
+        if (d->slots[i] < 0) {
+            d->slots[i] = s;
+            break;
+        }
+    }
+    return s;
+}
+
+int dfa_start(Dfa *d) {
+    if (d->start < 0) {
+        int n = 0;
+        d->gen++;
+        dfa_closure(d, d->nfa.start, &n);
+        d->start = dfa_state(d, n);
+    }
+    return d->start;
+}
+
+// The state after reading symbol class cls in state s.
+int dfa_step(Dfa *d, int s, int cls) {
+    int t = d->trans[(size_t)s * d->stride + cls];
+    if (t >= 0) return t;
+    int sym = d->class_sym[cls];
+    int n = 0;
+    d->gen++;
+    const int *set = d->pool + d->set_offset[s];
+    int len = d->set_len[s];
+    for (int i = 0; i < len; i++) {
+        const NfaState *ns = &d->nfa.states[set[i]];
+        if (ns->type == NFA_SET && symset_has(&ns->set, sym)) dfa_closure(d, ns->out, &n);
+    }
+    // The line boundaries take no room, so after one is read the states
+    // that want it again (as in ^^ or a -x pattern that starts with ^)
+    // are satisfied too.
+    if (sym >= 256) {
+        for (int i = 0; i < n; i++) {
+            const NfaState *ns = &d->nfa.states[d->work[i]];
+            if (ns->type == NFA_SET && symset_has(&ns->set, sym)) dfa_closure(d, ns->out, &n);
+        }
+    }
+    unsigned flushes = d->flushes;
+    t = dfa_state(d, n);
+    if (flushes == d->flushes) {
+        d->trans[(size_t)s * d->stride + cls] = t;
+        if (!d->special[cls] && !(d->flags[t] & DFA_ACCEPT) && t != d->idle) d->fast[(size_t)s * d->stride + cls] = t * d->stride;
+    }
+    return t;
+}
+
+#define DFA_IDLE_MAX_STOPS 16
+
+// Work out which bytes leave the start state, and make it the idle state
+// if there are few enough of them to be worth skipping to.  This runs once
+// per flush of the cache.
+void dfa_find_idle(Dfa *d, char eol) {
+    d->idle_epoch = d->flushes + 1;
+    unsigned flushes = d->flushes;
+    int s = dfa_start(d);
+    int stops = 0;
+    if (d->flags[s] & DFA_ACCEPT) return;
+    for (int b = 0; b < 256; b++) {
+        int cls = d->byte_class[b];
+        d->idle_stop[b] = b == (unsigned char)eol || dfa_step(d, s, cls) != s;
+        if (flushes != d->flushes) return;
+        stops += d->idle_stop[b];
+    }
+    if (stops > DFA_IDLE_MAX_STOPS) return;
+    d->idle = s;
+    int off = s * d->stride;
+    for (size_t i = 0; i < (size_t)d->num_states * d->stride; i++) {
+        if (d->fast[i] == off) d->fast[i] = -1;
+    }
+}
+
+// Whether reading class cls in state s leads to an accepting state.  The
+// step can grow d->flags, so it has to happen before flags is read.
+int dfa_step_accepts(Dfa *d, int s, int cls) {
+    int t = dfa_step(d, s, cls);
+    return (d->flags[t] & DFA_ACCEPT) != 0;
+}
+
+// Whether the line has a match, for an unanchored forward DFA.
+int dfa_match_line(Dfa *d, const char *line, size_t len) {
+    const unsigned char *p = (const unsigned char *)line;
+    int s = dfa_step(d, dfa_start(d), d->bol);
+    for (size_t i = 0; i < len; i++) {
+        if (d->flags[s] & DFA_ACCEPT) return 1;
+        s = dfa_step(d, s, d->byte_class[p[i]]);
+    }
+    if (d->flags[s] & DFA_ACCEPT) return 1;
+    return dfa_step_accepts(d, s, d->eol);
+}
+
+// Find the first line in [start, end) that an unanchored forward DFA
+// accepts, running the whole buffer through the automaton.  CRs before
+// the newline are not part of the line, so the state before them is the
+// one that sees the end of line; a hit inside such a run of CRs is only a
+// candidate, and *verify is set so the caller checks the line on its own.
+const char *dfa_find_line(Dfa *d, const char *start, const char *end, char eol, int *verify) {
+    const unsigned char *p = (const unsigned char *)start;
+    const unsigned char *e = (const unsigned char *)end;
+    const char *line = start;
+    int cr_state = -1;
+    unsigned cr_flushes = 0;
+    *verify = 0;
+    if (p >= e) return NULL;
+    if (d->idle_epoch != d->flushes + 1) dfa_find_idle(d, eol);
+    int s = dfa_step(d, dfa_start(d), d->bol);
+    if (d->flags[s] & DFA_ACCEPT) return line;
+    while (1) {
+        // Most bytes take a known transition to a state that does not
+        // accept; run those without looking at anything else.
+        const unsigned char *run = p;
+        int off = s * d->stride;
+        while (p < e) {
+            int t = d->fast[off + d->byte_class[*p]];
+            if (t < 0) break;
+            off = t;
+            p++;
+        }
+        s = off / d->stride;
+        if (p > run) cr_state = -1;
+        if (s == d->idle) {
+            run = p;
+            while (p < e && !d->idle_stop[*p]) p++;
+            // The state before a run of CRs is idle unless the run began
+            // before the skip.
+            if (p > run) {
+                if (eol == '\n' && p[-1] == '\r') {
+                    const unsigned char *r = p;
+                    while (r > run && r[-1] == '\r') r--;
+                    if (r > run || cr_state < 0) {
+                        cr_state = s;
+                        cr_flushes = d->flushes;
+                    }
+                } else {
+                    cr_state = -1;
+                }
+            }
+        }
+        if (p == e) break;
+        unsigned char b = *p;
+        if (b == (unsigned char)eol) {
+            int last = s;
+            if (cr_state >= 0) {
+                if (cr_flushes != d->flushes) {
+                    *verify = 1;
+                    return line;
+                }
+                last = cr_state;
+            }
+            if (dfa_step_accepts(d, last, d->eol)) return line;
+            line = (const char *)++p;
+            if (p == e) return NULL;
+            cr_state = -1;
+            s = dfa_step(d, dfa_start(d), d->bol);
+            if (d->flags[s] & DFA_ACCEPT) return line;
+            continue;
+        }
+        if (b == '\r' && eol == '\n') {
+            if (cr_state < 0) {
+                cr_state = s;
+                cr_flushes = d->flushes;
+            }
+        } else {
+            cr_state = -1;
+        }
+        s = dfa_step(d, s, d->byte_class[b]);
+        p++;
+        if (d->flags[s] & DFA_ACCEPT) {
+            *verify = cr_state >= 0;
+            return line;
+        }
+    }
+    // The last line has no terminator.
+    if (cr_state >= 0) {
+        if (cr_flushes != d->flushes) {
+            *verify = 1;
+            return line;
+        }
+        s = cr_state;
+    }
+    return dfa_step_accepts(d, s, d->eol) ? line : NULL;
+}
+
+// A compiled -G/-E pattern.  search selects lines; for the matched text,
+// reverse finds where the leftmost match starts and anchored how far the
+// longest match from there extends.
+typedef struct {
+    Dfa *search;
+    Dfa *anchored;
+    Dfa *reverse;
+    int word;
+} Regex;
+
+Regex *regex_new(RxParser *rp, RxNode *node, int word_regexp, int line_regexp, char eol) {
+    Regex *rx = calloc(1, sizeof(Regex));
+    if (line_regexp) {
+        node = rx_cat(rp, rx_symbol(rp, SYM_BOL), rx_cat(rp, node, rx_symbol(rp, SYM_EOL)));
+    }
+    RxNode *search = node;
+    if (word_regexp) {
+        // A line holds a whole-word match if some match has a non-word
+        // character or the line boundary on each side.
+        SymbolSet before = {{0}}, after = {{0}};
+        for (int c = 0; c < 256; c++) {
+            if (!is_word_char(c)) {
+                symset_add(&before, c);
+                symset_add(&after, c);
+            }
+        }
+        symset_add(&before, SYM_BOL);
+        symset_add(&after, SYM_EOL);
+        search = rx_cat(rp, rx_set(rp, &before), rx_cat(rp, node, rx_set(rp, &after)));
+    }
+    rx->search = dfa_new(search, 0, 1, eol);
+    // An optional BOL lets an anchored match start at offset 0 either
+    // before or after the start of line.
+    rx->anchored = dfa_new(rx_cat(rp, rx_node(rp, RX_QUEST, rx_symbol(rp, SYM_BOL), NULL), node), 0, 0, eol);
+    rx->reverse = dfa_new(node, 1, 1, eol);
+    rx->word = word_regexp;
+    return rx;
+}
+
+Regex *regex_clone(const Regex *src) {
+    Regex *rx = calloc(1, sizeof(Regex));
+    rx->search = dfa_clone(src->search);
+    rx->anchored = dfa_clone(src->anchored);
+    rx->reverse = dfa_clone(src->reverse);
+    rx->word = src->word;
+    return rx;
+}
+
+// Leftmost offset >= from where a match starts, or -1.
+long regex_leftmost_start(Regex *rx, const char *line, size_t len, size_t from) {
+    Dfa *d = rx->reverse;
+    const unsigned char *p = (const unsigned char *)line;
+    long best = -1;
+    int s = dfa_start(d);
+    if (d->flags[s] & DFA_ACCEPT) best = (long)len;
+    s = dfa_step(d, s, d->eol);
+    if (d->flags[s] & DFA_ACCEPT) best = (long)len;
+    for (size_t i = len; i-- > from; ) {
+        s = dfa_step(d, s, d->byte_class[p[i]]);
+        if (d->flags[s] & DFA_ACCEPT) best = (long)i;
+    }
+    if (from == 0 && dfa_step_accepts(d, s, d->bol)) best = 0;
+    return best;
+}
+
+// End of the longest match starting at start, or -1.  Under -w only ends
+// followed by a non-word character or the end of line count.
+long regex_longest_end(Regex *rx, const char *line, size_t len, size_t start) {
+    Dfa *d = rx->anchored;
+    const unsigned char *p = (const unsigned char *)line;
+    long best = -1;
+    int s = dfa_start(d);
+    if (start == 0) s = dfa_step(d, s, d->bol);
+    for (size_t i = start; ; i++) {
+        if ((d->flags[s] & DFA_ACCEPT) && (!rx->word || i == len || !is_word_char(p[i]))) best = (long)i;
+        if (i == len || (d->flags[s] & DFA_DEAD)) break;
+        s = dfa_step(d, s, d->byte_class[p[i]]);
+    }
+    if (dfa_step_accepts(d, s, d->eol)) best = (long)len;
+    return best;
+}
+
+// Find the leftmost-longest match in line at or after from.
+int regex_next_match(Regex *rx, const char *line, size_t len, size_t from, size_t *match_start, size_t *match_end) {
+    while (from <= len) {
+        long start = regex_leftmost_start(rx, line, len, from);
+        if (start < 0) return 0;
+        if (!rx->word || start == 0 || !is_word_char(line[start - 1])) {
+            long end = regex_longest_end(rx, line, len, start);
+            if (end >= 0) {
+                *match_start = start;
+                *match_end = end;
+                return 1;
+            }
+        }
+        from = start + 1;
+    }
+    return 0;
+}
+
+#define BLOCK_SIZE (256 * 1024)
+
+#define ENGINE_FIXED 0
+#define ENGINE_DFA 1
+#define ENGINE_PCRE 2
+
+typedef struct ResultCache ResultCache;
+
+typedef struct {
+    int ignore_case;
+    int invert_match;
+    int line_number;
+    int list_files;
+    int count;
+    int no_filename;
+    int with_filename;
+    int recursive;
+    char **patterns;
+    size_t *pattern_lens;
+    int num_patterns;
+    int patterns_cap;
+    char *pattern_file;
+    int pattern_type; // 0 basic, 1 extended, 2 fixed, 3 perl
+    int word_regexp;
+    int line_regexp;
+    int null_data;
+    int no_messages;
+    int max_count;
+    int byte_offset;
+    int line_buffered;
+    char *label;
+    int only_matching;
+    int quiet;
+    int binary_files_type; // 0 binary, 1 text, 2 without-match
+    int directories_action; // 0 read, 1 recurse, 2 skip
+    int devices_action; // 0 read, 1 skip
+    int dereference_recursive;
+    GlobSet *include_globs;
+    GlobSet *exclude_globs;
+    GlobSet *exclude_dir_globs;
+    int num_glob_rules;
+    int first_glob_include;
+    int files_without_match;
+    int initial_tab;
+    int null_output;
+    int before_context;
+    int after_context;
+    int context;
+    char *group_separator;
+    int no_group_separator;
+    int color;
+    int binary_option;
+    int color_when; // 0 never, 1 always, 2 auto
+    int threads;
+    int sort_path;
+    int gitignore;
+    char *index_build;
+    int use_index;
+    char *cache_file;
+    ResultCache *cache;
+    int follow;
+    int decompress;
+    pcre2_code *code;
+    pcre2_code **codes; // the -P programs, when one cannot hold them all
+    int num_codes;
+    pcre2_code *buffer_code;
+    int buffer_dollar; // buffer_code uses $, which stops before \n only
+    int use_jit;
+    pcre2_match_data *match_data;
+    pcre2_match_context *match_context;
+    pcre2_jit_stack *jit_stack;
+    int engine;
+    Regex *regex;
+    LiteralSet *fixed_set;
+    LiteralSet *literal_set;
+} Options;
+
+void print_usage() {
+    printf("Usage: grep [OPTION]... PATTERNS [FILE]...\n");
+    printf("Search for PATTERNS in each FILE.\n");
+    printf("Example: grep -i 'hello world' menu.h main.c\n");
+    printf("PATTERNS can contain multiple patterns separated by newlines.\n");
+    printf("\n");
+    printf("Pattern selection and interpretation:\n");
+    printf("  -E, --extended-regexp     PATTERNS are extended regular expressions\n");
+    printf("  -F, --fixed-strings       PATTERNS are strings\n");
+    printf("  -G, --basic-regexp        PATTERNS are basic regular expressions\n");
+    printf("  -P, --perl-regexp         PATTERNS are Perl regular expressions\n");
+    printf("  -e, --regexp=PATTERNS     use PATTERNS for matching\n");
+    printf("  -f, --file=FILE           take PATTERNS from FILE\n");
+    printf("  -i, --ignore-case         ignore case distinctions in patterns and data\n");
+    printf("      --no-ignore-case      do not ignore case distinctions (default)\n");
+    printf("  -w, --word-regexp         match only whole words\n");
+    printf("  -x, --line-regexp         match only whole lines\n");
+    printf("  -z, --null-data           a data line ends in 0 byte, not newline\n");
+    printf("\n");
+    printf("Miscellaneous:\n");
+    printf("  -s, --no-messages         suppress error messages\n");
+    printf("  -v, --invert-match        select non-matching lines\n");
+    printf("  -V, --version             display version information and exit\n");
+    printf("  -j, --threads=NUM         search files with NUM threads (0: one per CPU)\n");
+    printf("      --help                display this help text and exit\n");
+    printf("\n");
+    printf("Output control:\n");
+    printf("  -m, --max-count=NUM       stop after NUM selected lines\n");
+    printf("  -b, --byte-offset         print the byte offset with output lines\n");
+    printf("  -n, --line-number         print line number with output lines\n");
+    printf("      --line-buffered       flush output on every line\n");
+    printf("  -H, --with-filename       print file name with output lines\n");
+    printf("  -h, --no-filename         suppress the file name prefix on output\n");
+    printf("      --label=LABEL         use LABEL as the standard input file name prefix\n");
+    printf("  -o, --only-matching       show only nonempty parts of lines that match\n");
+    printf("  -q, --quiet, --silent     suppress all normal output\n");
+    printf("      --binary-files=TYPE   assume that binary files are TYPE;\n");
+    printf("                            TYPE is 'binary', 'text', or 'without-match'\n");
+    printf("  -a, --text                equivalent to --binary-files=text\n");
+    printf("  -I                        equivalent to --binary-files=without-match\n");
+    printf("  -d, --directories=ACTION  how to handle directories;\n");
+    printf("                            ACTION is 'read', 'recurse', or 'skip'\n");
+    printf("  -D, --devices=ACTION      how to handle devices, FIFOs and sockets;\n");
+    printf("                            ACTION is 'read' or 'skip'\n");
+    printf("  -r, --recursive           like --directories=recurse\n");
+    printf("  -R, --dereference-recursive  likewise, but follow all symlinks\n");
+    printf("      --include=GLOB        search only files that match GLOB (a file pattern)\n");
+    printf("      --exclude=GLOB        skip files that match GLOB\n");
+    printf("      --exclude-from=FILE   skip files that match any file pattern from FILE\n");
+    printf("      --exclude-dir=GLOB    skip directories that match GLOB\n");
+    printf("      --gitignore           skip what .gitignore and .ignore files ignore\n");
+    printf("      --index-build=DIR     write a trigram index of the files under DIR\n");
+    printf("      --index               use the index of searched directories\n");
+    printf("      --cache=FILE          reuse the results of unchanged files kept in FILE\n");
+    printf("      --follow              keep searching data appended to each FILE\n");
+    printf("      --decompress          search the contents of gzip and zstd files\n");
+    printf("  -L, --files-without-match  print only names of FILEs with no selected lines\n");
+    printf("  -l, --files-with-matches  print only names of FILEs with selected lines\n");
+    printf("  -c, --count               print only a count of selected lines per FILE\n");
+    printf("  -T, --initial-tab         make tabs line up (if needed)\n");
+    printf("  -Z, --null                print 0 byte after FILE name\n");
+    printf("      --sort=ORDER          print files in ORDER: 'path' (operand order,\n");
+    printf("                            then by name) or 'none' (default; with -j,\n");
+    printf("                            as they finish)\n");
+    printf("\n");
+    printf("Context control:\n");
+    printf("  -B, --before-context=NUM  print NUM lines of leading context\n");
+    printf("  -A, --after-context=NUM   print NUM lines of trailing context\n");
+    printf("  -C, --context=NUM         print NUM lines of output context\n");
+    printf("  -NUM                      same as --context=NUM\n");
+    printf("      --group-separator=SEP  print SEP on line between matches with context\n");
+    printf("      --no-group-separator  do not print separator for matches with context\n");
+    printf("      --color[=WHEN],\n");
+    printf("      --colour[=WHEN]       use markers to highlight the matching strings;\n");
+    printf("                            WHEN is 'always', 'never', or 'auto'\n");
+    printf("  -U, --binary              do not strip CR characters at EOL (MSDOS/Windows)\n");
+    printf("\n");
+    printf("When FILE is '-', read standard input.  With no FILE, read '.' if\n");
+    printf("recursive, '-' otherwise.  With fewer than two FILEs, assume -h.\n");
+    printf("Exit status is 0 if any line is selected, 1 otherwise;\n");
+    printf("if any error occurs and -q is not given, the exit status is 2.\n");
+    printf("\n");
+    printf("Report bugs to: bug-grep@gnu.org\n");
+    printf("GNU grep home page: <https://www.gnu.org/software/grep/>\n");
+    printf("General help using GNU software: <https://www.gnu.org/gethelp/>\n");
+}
+
+// Allocate the match data and JIT stack that regex_match uses.  Every
+// search thread has its own; the compiled code is shared.
+void regex_match_data_init(Options *opts) {
+    uint32_t pairs = 1;
+    for (int i = 0; i < opts->num_codes; i++) {
+        uint32_t count;
+        pcre2_pattern_info(opts->codes[i], PCRE2_INFO_CAPTURECOUNT, &count);
+        if (count + 1 > pairs) pairs = count + 1;
+    }
+    opts->match_data = pcre2_match_data_create(pairs, NULL);
+    opts->match_context = pcre2_match_context_create(NULL);
+    if (opts->use_jit) {
+        opts->jit_stack = pcre2_jit_stack_create(32 * 1024, 1024 * 1024, NULL);
+        if (opts->jit_stack) {
+            pcre2_jit_stack_assign(opts->match_context, NULL, opts->jit_stack);
+        }
+    }
+}
+
+// JIT-compile the pattern and allocate the match data and JIT stack once,
+// so the per-line match path never allocates.  When the JIT is not
+// available the interpreter is used with the same match data.
+void regex_context_init(Options *opts) {
+    opts->use_jit = pcre2_jit_compile(opts->code, PCRE2_JIT_COMPLETE) == 0;
+    if (opts->use_jit) {
+        for (int i = 1; i < opts->num_codes; i++) pcre2_jit_compile(opts->codes[i], PCRE2_JIT_COMPLETE);
+        if (opts->buffer_code) pcre2_jit_compile(opts->buffer_code, PCRE2_JIT_COMPLETE);
+    }
+    regex_match_data_init(opts);
+}
+
+// Returns the pcre2 result code; the match offsets are in opts->match_data.
+int regex_match(Options *opts, pcre2_code *code, const char *subject, size_t len, size_t offset) {
+    if (opts->use_jit) {
+        int rc = pcre2_jit_match(code, (PCRE2_SPTR)subject, len, offset, 0, opts->match_data, opts->match_context);
+        if (rc != PCRE2_ERROR_JIT_STACKLIMIT && rc != PCRE2_ERROR_JIT_BADOPTION) return rc;
+    }
+    return pcre2_match(code, (PCRE2_SPTR)subject, len, offset, PCRE2_NO_JIT, opts->match_data, opts->match_context);
+}
+
+// Find the leftmost match of the -P programs in subject at or after
+// offset.  Between programs matching at the same place the first wins, as
+// it would in an alternation.
+int regex_search(Options *opts, const char *subject, size_t len, size_t offset, size_t *start, size_t *end) {
+    int found = 0;
+    PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(opts->match_data);
+    for (int i = 0; i < opts->num_codes; i++) {
+        if (regex_match(opts, opts->codes[i], subject, len, offset) <= 0) continue;
+        if (!found || ovector[0] < *start) {
+            *start = ovector[0];
+            *end = ovector[1];
+            found = 1;
+        }
+        if (*start == offset) break;
+    }
+    return found;
+}
+
+// Whether a pattern can be searched for across a whole buffer of lines.
+// The buffer program may only narrow the search, so it must match
+// wherever the line program matches a line.  Assertions that look at the
+// subject boundaries or past the end of the current line would behave
+// differently there.  Possessive quantifiers and atomic groups can consume
+// a newline and then refuse to give it back.  Inline options can turn off
+// PCRE2_MULTILINE.  Patterns with any of these keep the per-line search;
+// only (?: and (?| are let through among the (? constructs.
+int regex_buffer_safe(const char *pat) {
+    static const char *unsafe[] = { "(*", "\\A", "\\z", "\\Z", "\\G", "\\K", "*+", "++", "?+", "}+" };
+    for (size_t i = 0; i < sizeof(unsafe) / sizeof(unsafe[0]); i++) {
+        if (strstr(pat, unsafe[i])) return 0;
+    }
+    for (const char *p = strstr(pat, "(?"); p; p = strstr(p + 2, "(?")) {
+        if (p[2] != ':' && p[2] != '|') return 0;
+    }
+    return 1;
+}
+
+// Add the newline-separated patterns in text[0..len).  The pattern list
+// grows as needed; large -f files are expected.
+void add_patterns(Options *opts, const char *text, size_t len) {
+    const char *end = text + len;
+    while (1) {
+        const char *nl = memchr(text, '\n', end - text);
+        size_t n = (nl ? nl : end) - text;
+        while (n > 0 && text[n-1] == '\r') n--;
+        if (opts->num_patterns == opts->patterns_cap) {
+            opts->patterns_cap = opts->patterns_cap ? opts->patterns_cap * 2 : 16;
+            opts->patterns = realloc(opts->patterns, opts->patterns_cap * sizeof(char *));
+            opts->pattern_lens = realloc(opts->pattern_lens, opts->patterns_cap * sizeof(size_t));
+        }
+        char *pat = malloc(n + 1);
+        memcpy(pat, text, n);
+        pat[n] = '\0';
+        opts->patterns[opts->num_patterns] = pat;
+        opts->pattern_lens[opts->num_patterns] = n;
+        opts->num_patterns++;
+        if (!nl) break;
+        text = nl + 1;
+    }
+}
+
+void add_file_glob(Options *opts, const char *glob, int include) {
+    if (opts->num_glob_rules == 0) opts->first_glob_include = include;
+    glob_set_add(include ? &opts->include_globs : &opts->exclude_globs, glob, opts->num_glob_rules++);
+}
+
+// Read a whole line of fp, without its terminator, into *buf, which
+// grows as needed.  Returns 0 at end of file.
+int read_text_line(FILE *fp, char **buf, size_t *cap) {
+    size_t len = 0;
+    int c;
+    while ((c = getc(fp)) != EOF && c != '\n') {
+        if (len + 1 >= *cap) {
+            *cap = *cap ? *cap * 2 : 256;
+            *buf = realloc(*buf, *cap);
+        }
+        (*buf)[len++] = (char)c;
+    }
+    if (c == EOF && len == 0) return 0;
+    if (!*buf) {
+        *cap = 256;
+        *buf = malloc(*cap);
+    }
+    while (len > 0 && (*buf)[len-1] == '\r') len--;
+    (*buf)[len] = '\0';
+    return 1;
+}
+
+// --exclude-from: one glob per line, read once while parsing options.
+int read_exclude_from(Options *opts, const char *filename) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(stderr, "grep: %s: %s\n", filename, strerror(errno));
+        return 1;
+    }
+    char *buf = NULL;
+    size_t cap = 0;
+    while (read_text_line(fp, &buf, &cap)) {
+        if (buf[0]) add_file_glob(opts, buf, 0);
+    }
+    free(buf);
+    fclose(fp);
+    return 0;
+}
+
+// Required literal analysis.  A pattern like ERROR.*timeout=\d+ cannot
+// match a line that lacks "ERROR", so lines are first located with a plain
+// literal search and the regex engine only runs on those candidates.  -P
+// patterns are analyzed from their text; the analysis is conservative:
+// anything it does not fully understand ends the current literal run, and
+// constructs that could change case sensitivity make it give up
+// altogether.  -G/-E patterns are analyzed on their syntax tree.
+
+#define MIN_LITERAL_LEN 2
+
+typedef struct {
+    char *text;
+    size_t len;
+    size_t cap;
+    size_t unit_start;
+} LiteralRun;
+
+void run_append(LiteralRun *run, const char *s, size_t n) {
+    if (run->len + n > run->cap) {
+        run->cap = (run->len + n) * 2;
+        run->text = realloc(run->text, run->cap);
+    }
+    run->unit_start = run->len;
+    memcpy(run->text + run->len, s, n);
+    run->len += n;
+}
+
+// End the current run, keeping it if it beats the best one so far.
+void run_break(LiteralRun *run, LiteralRun *best) {
+    if (run->len > best->len) {
+        best->text = realloc(best->text, run->len);
+        memcpy(best->text, run->text, run->len);
+        best->len = run->len;
+    }
+    run->len = 0;
+}
+
+// Skip a bracket expression starting at '['.
+const char *skip_class(const char *p, const char *end) {
+    p++;
+    if (p < end && *p == '^') p++;
+    if (p < end && *p == ']') p++;
+    while (p < end && *p != ']') {
+        if (*p == '\\' && p + 1 < end) {
+            p += 2;
+        } else if (*p == '[' && p + 1 < end && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+            char kind = p[1];
+            p += 2;
+            while (p + 1 < end && !(p[0] == kind && p[1] == ']')) p++;
+            p += 2;
+        } else {
+            p++;
+        }
+    }
+    return p < end ? p + 1 : end;
+}
+
+// Skip an escape starting at '\' that is not a literal character.
+const char *skip_escape(const char *p, const char *end) {
+    p++;
+    if (p >= end) return end;
+    char c = *p++;
+    if (p < end && *p == '{' && strchr("xopPNgk", c)) {
+        while (p < end && *p != '}') p++;
+        return p < end ? p + 1 : end;
+    }
+    if (p < end && (*p == '<' || *p == '\'') && (c == 'k' || c == 'g')) {
+        char close = *p == '<' ? '>' : '\'';
+        while (p < end && *p != close) p++;
+        return p < end ? p + 1 : end;
+    }
+    if (c == 'x') {
+        for (int i = 0; i < 2 && p < end && isxdigit((unsigned char)*p); i++) p++;
+    } else if (c == 'c') {
+        if (p < end) p++;
+    } else if (isdigit((unsigned char)c)) {
+        while (p < end && isdigit((unsigned char)*p)) p++;
+    }
+    return p;
+}
+
+// Skip a group starting at '(', returning the position after ')'.
+const char *skip_group(const char *p, const char *end) {
+    int depth = 0;
+    while (p < end) {
+        if (*p == '\\') {
+            p += 2;
+            continue;
+        }
+        if (*p == '[') {
+            p = skip_class(p, end);
+            continue;
+        }
+        if (*p == '(') depth++;
+        if (*p == ')' && --depth == 0) return p + 1;
+        p++;
+    }
+    return end;
+}
+
+// Recognize a quantifier at p.  Returns its end (or p if there is none) and
+// sets *optional when it allows zero repetitions.
+const char *parse_quantifier(const char *p, const char *end, int *optional) {
+    *optional = 0;
+    if (p >= end) return p;
+    const char *q = p;
+    if (*q == '*' || *q == '?') {
+        *optional = 1;
+        q++;
+    } else if (*q == '+') {
+        q++;
+    } else if (*q == '{') {
+        const char *r = q + 1;
+        const char *digits = r;
+        while (r < end && isdigit((unsigned char)*r)) r++;
+        int min_zero = r == digits || atoi(digits) == 0;
+        if (r < end && *r == ',') {
+            r++;
+            while (r < end && isdigit((unsigned char)*r)) r++;
+        }
+        if (r >= end || *r != '}' || r == q + 1) return p;
+        *optional = min_zero;
+        q = r + 1;
+    } else {
+        return p;
+    }
+    if (q < end && (*q == '+' || *q == '?')) q++;
+    return q;
+}
+
+int has_top_level_alternation(const char *p, const char *end) {
+    int depth = 0;
+    while (p < end) {
+        if (*p == '\\') {
+            p += 2;
+            continue;
+        }
+        if (*p == '[') {
+            p = skip_class(p, end);
+            continue;
+        }
+        if (*p == '(') depth++;
+        else if (*p == ')') depth--;
+        else if (*p == '|' && depth == 0) return 1;
+        p++;
+    }
+    return 0;
+}
+
+int literal_char_ok(unsigned char c, int icase) {
+    // The caseless prefilter folds ASCII only, and under PCRE2_UTF 'k' and
+    // 's' also match the Kelvin sign and long s.
+    if (!icase) return 1;
+    return c < 0x80 && tolower(c) != 'k' && tolower(c) != 's';
+}
+
+// Find the longest literal that every match of the branch [p, end) must
+// contain.  Returns 0 if the branch uses constructs that make the analysis
+// unsafe.
+int analyze_branch(const char *p, const char *end, int icase, LiteralRun *best) {
+    LiteralRun run = {0};
+    int ok = 1;
+    while (p < end && ok) {
+        char c = *p;
+        const char *atom = p;
+        if (c == '(') {
+            run_break(&run, best);
+            if (p + 1 < end && p[1] == '*') {
+                ok = 0;
+                break;
+            }
+            const char *group_end = skip_group(p, end);
+            const char *body = p + 1;
+            int capture = 1;
+            if (body < end && *body == '?') {
+                if (body + 1 < end && body[1] == ':') {
+                    body += 2;
+                } else if (body + 1 < end && (body[1] == '<' || body[1] == '\'' || body[1] == 'P') &&
+                           body + 2 < end && body[2] != '=' && body[2] != '!') {
+                    char close = body[1] == '\'' ? '\'' : '>';
+                    while (body < group_end && *body != close) body++;
+                    body++;
+                } else if (body + 1 < end && (body[1] == '=' || body[1] == '!' || body[1] == '<')) {
+                    capture = 0;
+                } else {
+                    ok = 0;
+                    break;
+                }
+            }
+            int optional;
+            p = parse_quantifier(group_end, end, &optional);
+            if (capture && !optional && group_end - 1 > body && !has_top_level_alternation(body, group_end - 1)) {
+                ok = analyze_branch(body, group_end - 1, icase, best);
+            }
+            continue;
+        }
+        if (c == '[') {
+            run_break(&run, best);
+            p = skip_class(p, end);
+            int optional;
+            p = parse_quantifier(p, end, &optional);
+            continue;
+        }
+        if (c == '\\' && p + 1 < end && p[1] == 'Q') {
+            p += 2;
+            while (p < end && !(p[0] == '\\' && p + 1 < end && p[1] == 'E')) {
+                if (literal_char_ok((unsigned char)*p, icase)) {
+                    run_append(&run, p, 1);
+                } else {
+                    run_break(&run, best);
                 }
-                if (opts->num_patterns < MAX_PATTERNS) {
-                    opts->patterns[opts->num_patterns++] = argv[i];
+                p++;
+            }
+            if (p < end) p += 2;
+        } else if (c == '\\' && p + 1 < end && !isalnum((unsigned char)p[1])) {
+            if (literal_char_ok((unsigned char)p[1], icase)) {
+                run_append(&run, p + 1, 1);
+            } else {
+                run_break(&run, best);
+                atom = NULL;
+            }
+            p += 2;
+        } else if (c == '\\') {
+            run_break(&run, best);
+            p = skip_escape(p, end);
+            atom = NULL;
+        } else if (strchr(".^$)|", c)) {
+            run_break(&run, best);
+            p++;
+            atom = NULL;
+        } else {
+            size_t n = 1;
+            if ((unsigned char)c >= 0xC0) {
+                while (p + n < end && ((unsigned char)p[n] & 0xC0) == 0x80) n++;
+            }
+            if (literal_char_ok((unsigned char)c, icase)) {
+                run_append(&run, p, n);
+            } else {
+                run_break(&run, best);
+                atom = NULL;
+            }
+            p += n;
+        }
+        int optional;
+        const char *q = parse_quantifier(p, end, &optional);
+        if (q != p) {
+            // The quantifier applies to the last character only.
+            if (atom && optional && run.len > 0) run.len = run.unit_start;
+            run_break(&run, best);
+            p = q;
+        }
+    }
+    run_break(&run, best);
+    free(run.text);
+    return ok;
+}
+
+// Build opts->literal_set from strings of which every match contains at
+// least one: the best literal of each top-level alternative of each -P
+// pattern.
+void extract_literals(Options *opts) {
+    int n = 0;
+    char **lits = NULL;
+    size_t *lens = NULL;
+    for (int i = 0; i < opts->num_patterns; i++) {
+        const char *pat = opts->patterns[i];
+        const char *end = pat + strlen(pat);
+        const char *branch = pat;
+        int depth = 0;
+        for (const char *p = pat; ; ) {
+            if (p < end && *p == '\\') {
+                p += 2;
+                if (p > end) p = end;
+                continue;
+            }
+            if (p < end && *p == '[') {
+                p = skip_class(p, end);
+                continue;
+            }
+            if (p < end && *p == '(') depth++;
+            if (p < end && *p == ')') depth--;
+            if (p >= end || (*p == '|' && depth == 0)) {
+                LiteralRun best = {0};
+                int ok = analyze_branch(branch, p, opts->ignore_case, &best);
+                if (!ok || best.len < MIN_LITERAL_LEN) {
+                    free(best.text);
+                    for (int k = 0; k < n; k++) free(lits[k]);
+                    free(lits);
+                    free(lens);
+                    return;
+                }
+                lits = realloc(lits, (n + 1) * sizeof(char *));
+                lens = realloc(lens, (n + 1) * sizeof(size_t));
+                lits[n] = best.text;
+                lens[n] = best.len;
+                n++;
+                if (p >= end) break;
+                branch = p + 1;
+            }
+            p++;
+        }
+    }
+    opts->literal_set = literal_set_new((const char **)lits, lens, n, opts->ignore_case);
+}
+
+// The byte a set stands for if it matches exactly one character (both
+// cases of a letter under -i), or -1.
+int rx_literal_byte(const RxNode *node, int icase) {
+    if (node->type != RX_SET) return -1;
+    int found = -1, count = 0;
+    for (int c = 0; c < SYM_COUNT; c++) {
+        if (symset_has(&node->set, c)) {
+            if (found < 0) found = c;
+            count++;
+        }
+    }
+    if (found < 0 || found >= 256) return -1;
+    if (count == 1) return found;
+    if (icase && count == 2 && isalpha(found) && symset_has(&node->set, tolower(found)) && symset_has(&node->set, toupper(found))) {
+        return tolower(found);
+    }
+    return -1;
+}
+
+// If the pattern is a plain string, store it in run and return 1.
+int rx_plain_string(RxNode *node, int icase, LiteralRun *run) {
+    RxList items = {0};
+    rx_collect(node, RX_CAT, &items);
+    int ok = 1;
+    for (int i = 0; i < items.n && ok; i++) {
+        int c = rx_literal_byte(items.items[i], icase);
+        char b = (char)c;
+        if (c >= 0) {
+            run_append(run, &b, 1);
+        } else {
+            ok = items.items[i]->type == RX_EMPTY;
+        }
+    }
+    free(items.items);
+    return ok;
+}
+
+// Find the longest literal every match of a branch must contain; the same
+// analysis as analyze_branch, done on the syntax tree.
+void rx_required_literal(RxNode *node, int icase, LiteralRun *best) {
+    RxList items = {0};
+    LiteralRun run = {0};
+    rx_collect(node, RX_CAT, &items);
+    for (int i = 0; i < items.n; i++) {
+        RxNode *item = items.items[i];
+        int c = rx_literal_byte(item, icase);
+        char b = (char)c;
+        if (c >= 0 && literal_char_ok(c, icase)) {
+            run_append(&run, &b, 1);
+            continue;
+        }
+        run_break(&run, best);
+        if (item->type == RX_PLUS) rx_required_literal(item->left, icase, best);
+    }
+    run_break(&run, best);
+    free(run.text);
+    free(items.items);
+}
+
+
+// Build opts->literal_set from the best required literal of each top-level
+// alternative of a parsed -G/-E pattern list, if each is at least min_len
+// bytes long.
+void rx_extract_literals(Options *opts, RxNode *node, size_t min_len) {
+    RxList branches = {0};
+    rx_collect(node, RX_ALT, &branches);
+    char **lits = malloc(branches.n * sizeof(char *));
+    size_t *lens = malloc(branches.n * sizeof(size_t));
+    int n = 0;
+    for (; n < branches.n; n++) {
+        LiteralRun best = {0};
+        rx_required_literal(branches.items[n], opts->ignore_case, &best);
+        if (best.len < min_len) {
+            free(best.text);
+            break;
+        }
+        lits[n] = best.text;
+        lens[n] = best.len;
+    }
+    free(branches.items);
+    if (n < branches.n) {
+        for (int i = 0; i < n; i++) free(lits[i]);
+        free(lits);
+        free(lens);
+        return;
+    }
+    opts->literal_set = literal_set_new((const char **)lits, lens, n, opts->ignore_case);
+}
+
+uint32_t pcre_options(Options *opts) {
+    // PCRE2_MATCH_INVALID_UTF lets the JIT run safely over arbitrary bytes.
+    // It also drops the UTF check pcre2_match would make of every subject:
+    // invalid sequences simply never match, rather than failing the call.
+    // So there is no per-call check for PCRE2_NO_UTF_CHECK to skip, and no
+    // error to mistake for "no match", and buffers are not validated.
+    // Programs compiled without PCRE2_UTF for ASCII data measured no faster.
+    uint32_t options = PCRE2_UTF | PCRE2_MATCH_INVALID_UTF;
+    if (opts->ignore_case) options |= PCRE2_CASELESS;
+    return options;
+}
+
+void pcre_report_error(int errorcode) {
+    PCRE2_UCHAR buffer[256];
+    pcre2_get_error_message(errorcode, buffer, sizeof(buffer));
+    fprintf(stderr, "pcre2_compile failed: %s\n", buffer);
+}
+
+// Compile pat for pcre2, wrapped for -w and -x.  PCRE2 does the wrapping
+// itself, so verbs such as (*UCP) stay at the start of the pattern and an
+// (?x) comment cannot swallow the closing parenthesis.
+pcre2_code *compile_pcre_program(Options *opts, const char *pat, uint32_t options, int *errorcode) {
+    PCRE2_SIZE erroroffset;
+    pcre2_compile_context *ccontext = pcre2_compile_context_create(NULL);
+    uint32_t extra = 0;
+    if (opts->word_regexp) extra |= PCRE2_EXTRA_MATCH_WORD;
+    if (opts->line_regexp) extra |= PCRE2_EXTRA_MATCH_LINE;
+    pcre2_set_compile_extra_options(ccontext, extra);
+    pcre2_code *code = pcre2_compile((PCRE2_SPTR)pat, PCRE2_ZERO_TERMINATED, options, errorcode, &erroroffset, ccontext);
+    pcre2_compile_context_free(ccontext);
+    return code;
+}
+
+// Search with the n programs in codes, which opts takes over.  A single
+// program also gets a second one that treats the buffer as many lines:
+// ^ and $ match at every line boundary.  It keeps the newline convention
+// of the line program, so . and \N see a bare CR the same way in both.
+void pcre_use_programs(Options *opts, pcre2_code **codes, int n, const char *pat, uint32_t options) {
+    opts->codes = codes;
+    opts->num_codes = n;
+    opts->code = codes[0];
+    if (n == 1 && !opts->null_data && regex_buffer_safe(pat)) {
+        int errorcode;
+        opts->buffer_code = compile_pcre_program(opts, pat, options | PCRE2_MULTILINE, &errorcode);
+        opts->buffer_dollar = opts->line_regexp || strchr(pat, '$') != NULL;
+    }
+    regex_context_init(opts);
+    opts->engine = ENGINE_PCRE;
+}
+
+int compile_pcre(Options *opts, const char *pat) {
+    uint32_t options = pcre_options(opts);
+    int errorcode;
+    pcre2_code **codes = malloc(sizeof(pcre2_code *));
+    codes[0] = compile_pcre_program(opts, pat, options, &errorcode);
+    if (!codes[0]) {
+        pcre_report_error(errorcode);
+        free(codes);
+        return 1;
+    }
+    pcre_use_programs(opts, codes, 1, pat, options);
+    return 0;
+}
+
+// Whether an inline option setting in pat turns on (?x), under which a #
+// comment runs to the end of the pattern.
+int pcre_sets_extended(const char *pat) {
+    for (const char *p = strstr(pat, "(?"); p; p = strstr(p + 2, "(?")) {
+        for (const char *q = p + 2; *q == '^' || *q == '-' || isalpha((unsigned char)*q); q++) {
+            if (*q == 'x') return 1;
+        }
+    }
+    return 0;
+}
+
+// Whether pat calls a group as a subroutine or recurses: (?1), (?+1),
+// (?-1), (?R), (?&name), (?P>name), \g<...> or \g'...'.  Inside the joined
+// program these would reach the groups of other patterns, or all of them.
+int pcre_calls_groups(const char *pat) {
+    for (const char *p = strstr(pat, "(?"); p; p = strstr(p + 2, "(?")) {
+        char c = p[2];
+        if (isdigit((unsigned char)c) || c == 'R' || c == '+' || c == '&') return 1;
+        if (c == '-' && isdigit((unsigned char)p[3])) return 1;
+        if (c == 'P' && p[3] == '>') return 1;
+    }
+    return strstr(pat, "\\g<") || strstr(pat, "\\g'");
+}
+
+// Compile the -P patterns as one program, so a single pass tests them
+// all.  They are joined in a branch reset group, where each numbers its
+// groups from 1 and its backreferences keep their meaning.  Each is
+// compiled alone first, so one that only parses inside the others is
+// still an error.  The \E closes a \Q a pattern leaves open.
+//
+// Some valid lists cannot be joined: a verb such as (*UCP) is only
+// allowed at the start of the whole pattern, an (?x) comment would run
+// into the next pattern, subroutine calls and recursion would reach into
+// the other patterns, and the branches of a reset group cannot give the
+// same group different names.  Those keep a program per pattern.
+int compile_perl(Options *opts) {
+    extract_literals(opts);
+    if (opts->num_patterns == 1) return compile_pcre(opts, opts->patterns[0]);
+    uint32_t options = pcre_options(opts);
+    int n = opts->num_patterns;
+    pcre2_code **codes = malloc(n * sizeof(pcre2_code *));
+    int join = 1;
+    int errorcode;
+    for (int i = 0; i < n; i++) {
+        codes[i] = compile_pcre_program(opts, opts->patterns[i], options, &errorcode);
+        if (!codes[i]) {
+            pcre_report_error(errorcode);
+            for (int k = 0; k < i; k++) pcre2_code_free(codes[k]);
+            free(codes);
+            return 1;
+        }
+        const char *pat = opts->patterns[i];
+        if (strncmp(pat, "(*", 2) == 0 || pcre_sets_extended(pat) || pcre_calls_groups(pat)) join = 0;
+    }
+    if (join) {
+        size_t len = 8;
+        for (int i = 0; i < n; i++) len += opts->pattern_lens[i] + 8;
+        char *pat = malloc(len);
+        char *p = pat;
+        p += sprintf(p, "(?|");
+        for (int i = 0; i < n; i++) {
+            p += sprintf(p, "%s(?:%s\\E)", i > 0 ? "|" : "", opts->patterns[i]);
+        }
+        strcpy(p, ")");
+        pcre2_code *code = compile_pcre_program(opts, pat, options | PCRE2_DUPNAMES, &errorcode);
+        if (code) {
+            for (int i = 0; i < n; i++) pcre2_code_free(codes[i]);
+            codes[0] = code;
+            pcre_use_programs(opts, codes, 1, pat, options | PCRE2_DUPNAMES);
+            free(pat);
+            return 0;
+        }
+        free(pat);
+    }
+    pcre_use_programs(opts, codes, n, NULL, options);
+    return 0;
+}
+
+// Compile the -G/-E patterns.  A list of plain strings goes to the literal
+// search and patterns that need backreferences or word assertions to
+// pcre2; everything else runs on the DFA.
+int compile_posix(Options *opts) {
+    RxParser rp = {0};
+    rp.extended = opts->pattern_type == 1;
+    rp.icase = opts->ignore_case;
+    RxNode *all = NULL;
+    char **strings = malloc(opts->num_patterns * sizeof(char *));
+    size_t *lens = malloc(opts->num_patterns * sizeof(size_t));
+    int plain = 1;
+    for (int i = 0; i < opts->num_patterns; i++) {
+        rp.p = opts->patterns[i];
+        rp.end = rp.p + opts->pattern_lens[i];
+        rp.groups = 0;
+        rp.closed = 0;
+        if (i > 0) rx_emit_str(&rp, "|");
+        if (opts->num_patterns > 1) rx_emit_str(&rp, "(?:");
+        RxNode *node = rx_parse_alternation(&rp, 0);
+        if (rp.error) {
+            fprintf(stderr, "grep: %s\n", rp.error);
+            return 1;
+        }
+        if (opts->num_patterns > 1) rx_emit_str(&rp, ")");
+        rp.group_base += rp.groups;
+        LiteralRun run = {0};
+        if (plain && rx_plain_string(node, opts->ignore_case, &run)) {
+            strings[i] = run.text ? run.text : strdup("");
+            lens[i] = run.len;
+        } else {
+            free(run.text);
+            plain = 0;
+        }
+        all = rx_alt(&rp, all, node);
+    }
+    if (rp.needs_pcre) {
+        rx_extract_literals(opts, all, MIN_LITERAL_LEN);
+        return compile_pcre(opts, rp.pcre);
+    }
+    if (plain) {
+        opts->fixed_set = literal_set_new((const char **)strings, lens, opts->num_patterns, opts->ignore_case);
+        opts->engine = ENGINE_FIXED;
+        return 0;
+    }
+    // Checking a candidate line costs the DFA little, so even a single
+    // required byte is worth searching for.
+    rx_extract_literals(opts, all, 1);
+    opts->regex = regex_new(&rp, all, opts->word_regexp, opts->line_regexp, opts->null_data ? '\0' : '\n');
+    opts->engine = ENGINE_DFA;
+    return 0;
+}
+
+int parse_options(int argc, char *argv[], Options *opts, int *argi) {
+    opts->ignore_case = 0;
+    opts->invert_match = 0;
+    opts->line_number = 0;
+    opts->list_files = 0;
+    opts->count = 0;
+    opts->no_filename = 0;
+    opts->with_filename = 0;
+    opts->recursive = 0;
+    opts->patterns = NULL;
+    opts->pattern_lens = NULL;
+    opts->num_patterns = 0;
+    opts->patterns_cap = 0;
+    opts->pattern_file = NULL;
+    opts->pattern_type = 0; // basic
+    opts->word_regexp = 0;
+    opts->line_regexp = 0;
+    opts->null_data = 0;
+    opts->no_messages = 0;
+    opts->max_count = -1;
+    opts->byte_offset = 0;
+    opts->line_buffered = 0;
+    opts->label = NULL;
+    opts->only_matching = 0;
+    opts->quiet = 0;
+    opts->binary_files_type = 0; // binary
+    opts->directories_action = 0; // read
+    opts->devices_action = 0; // read
+    opts->dereference_recursive = 0;
+    opts->include_globs = NULL;
+    opts->exclude_globs = NULL;
+    opts->exclude_dir_globs = NULL;
+    opts->num_glob_rules = 0;
+    opts->first_glob_include = 0;
+    opts->files_without_match = 0;
+    opts->initial_tab = 0;
+    opts->null_output = 0;
+    opts->before_context = 0;
+    opts->after_context = 0;
+    opts->context = 0;
+    opts->group_separator = "--";
+    opts->no_group_separator = 0;
+    opts->color = 0;
+    opts->binary_option = 0;
+    opts->color_when = 2; // auto
+    opts->threads = 1;
+    opts->sort_path = 0;
+    opts->gitignore = 0;
+    opts->index_build = NULL;
+    opts->use_index = 0;
+    opts->cache_file = NULL;
+    opts->cache = NULL;
+    opts->follow = 0;
+    opts->decompress = 0;
+    opts->code = NULL;
+    opts->codes = NULL;
+    opts->num_codes = 0;
+    opts->buffer_code = NULL;
+    opts->buffer_dollar = 0;
+    opts->use_jit = 0;
+    opts->match_data = NULL;
+    opts->match_context = NULL;
+    opts->jit_stack = NULL;
+    opts->engine = ENGINE_FIXED;
+    opts->regex = NULL;
+    opts->fixed_set = NULL;
+    opts->literal_set = NULL;
+
+    int i = *argi;
+    while (i < argc) {
+        if (argv[i][0] == '-') {
+            if (strcmp(argv[i], "-i") == 0) {
+                opts->ignore_case = 1;
+            } else if (strcmp(argv[i], "-v") == 0) {
+                opts->invert_match = 1;
+            } else if (strcmp(argv[i], "-n") == 0) {
+                opts->line_number = 1;
+            } else if (strcmp(argv[i], "-l") == 0) {
+                opts->list_files = 1;
+            } else if (strcmp(argv[i], "-c") == 0) {
+                opts->count = 1;
+            } else if (strcmp(argv[i], "-h") == 0) {
+                opts->no_filename = 1;
+            } else if (strcmp(argv[i], "-H") == 0) {
+                opts->with_filename = 1;
+            } else if (strcmp(argv[i], "-r") == 0) {
+                opts->recursive = 1;
+            } else if (strcmp(argv[i], "-e") == 0) {
+                i++;
+                if (i >= argc) {
+                    fprintf(stderr, "grep: option requires an argument -- 'e'\n");
+                    return 1;
                 }
+                add_patterns(opts, argv[i], strlen(argv[i]));
             } else if (strcmp(argv[i], "-f") == 0) {
                 i++;
                 if (i >= argc) {
@@ -365,36 +3061,62 @@ int parse_options(int argc, char *argv[], Options *opts, int *argi) {
                     fprintf(stderr, "grep: option requires an argument -- '--include'\n");
                     return 1;
                 }
-                opts->include_glob = argv[i];
+                add_file_glob(opts, argv[i], 1);
             } else if (strncmp(argv[i], "--include=", 10) == 0) {
-                opts->include_glob = argv[i] + 10;
+                add_file_glob(opts, argv[i] + 10, 1);
             } else if (strcmp(argv[i], "--exclude") == 0) {
                 i++;
                 if (i >= argc) {
                     fprintf(stderr, "grep: option requires an argument -- '--exclude'\n");
                     return 1;
                 }
-                opts->exclude_glob = argv[i];
+                add_file_glob(opts, argv[i], 0);
             } else if (strncmp(argv[i], "--exclude=", 10) == 0) {
-                opts->exclude_glob = argv[i] + 10;
+                add_file_glob(opts, argv[i] + 10, 0);
             } else if (strcmp(argv[i], "--exclude-from") == 0) {
                 i++;
                 if (i >= argc) {
-                    fprintf(stderr, "grep: option requires an argument -- '--exclude-from'\n");
+                    fprintf(stderr, "grep: option requires an argument -- '--exclude-from'\n");
+                    return 1;
+                }
+                if (read_exclude_from(opts, argv[i])) return 1;
+            } else if (strncmp(argv[i], "--exclude-from=", 15) == 0) {
+                if (read_exclude_from(opts, argv[i] + 15)) return 1;
+            } else if (strcmp(argv[i], "--exclude-dir") == 0) {
+                i++;
+                if (i >= argc) {
+                    fprintf(stderr, "grep: option requires an argument -- '--exclude-dir'\n");
+                    return 1;
+                }
+                glob_set_add(&opts->exclude_dir_globs, argv[i], 0);
+            } else if (strncmp(argv[i], "--exclude-dir=", 14) == 0) {
+                glob_set_add(&opts->exclude_dir_globs, argv[i] + 14, 0);
+            } else if (strcmp(argv[i], "--gitignore") == 0) {
+                opts->gitignore = 1;
+            } else if (strcmp(argv[i], "--index-build") == 0) {
+                i++;
+                if (i >= argc) {
+                    fprintf(stderr, "grep: option requires an argument -- '--index-build'\n");
                     return 1;
                 }
-                opts->exclude_from = argv[i];
-            } else if (strncmp(argv[i], "--exclude-from=", 16) == 0) {
-                opts->exclude_from = argv[i] + 16;
-            } else if (strcmp(argv[i], "--exclude-dir") == 0) {
+                opts->index_build = argv[i];
+            } else if (strncmp(argv[i], "--index-build=", 14) == 0) {
+                opts->index_build = argv[i] + 14;
+            } else if (strcmp(argv[i], "--index") == 0) {
+                opts->use_index = 1;
+            } else if (strcmp(argv[i], "--cache") == 0) {
                 i++;
                 if (i >= argc) {
-                    fprintf(stderr, "grep: option requires an argument -- '--exclude-dir'\n");
+                    fprintf(stderr, "grep: option requires an argument -- '--cache'\n");
                     return 1;
                 }
-                opts->exclude_dir = argv[i];
-            } else if (strncmp(argv[i], "--exclude-dir=", 14) == 0) {
-                opts->exclude_dir = argv[i] + 14;
+                opts->cache_file = argv[i];
+            } else if (strncmp(argv[i], "--cache=", 8) == 0) {
+                opts->cache_file = argv[i] + 8;
+            } else if (strcmp(argv[i], "--follow") == 0) {
+                opts->follow = 1;
+            } else if (strcmp(argv[i], "--decompress") == 0) {
+                opts->decompress = 1;
             } else if (strcmp(argv[i], "-L") == 0 || strcmp(argv[i], "--files-without-match") == 0) {
                 opts->files_without_match = 1;
             } else if (strcmp(argv[i], "--group-separator") == 0) {
@@ -413,6 +3135,8 @@ int parse_options(int argc, char *argv[], Options *opts, int *argi) {
                     return 1;
                 }
                 opts->label = argv[i];
+            } else if (strncmp(argv[i], "--label=", 8) == 0) {
+                opts->label = argv[i] + 8;
             } else if (strcmp(argv[i], "--binary-files") == 0) {
                 i++;
                 if (i >= argc) {
@@ -422,540 +3146,3005 @@ int parse_options(int argc, char *argv[], Options *opts, int *argi) {
                 if (strcmp(argv[i], "binary") == 0) opts->binary_files_type = 0;
                 else if (strcmp(argv[i], "text") == 0) opts->binary_files_type = 1;
                 else if (strcmp(argv[i], "without-match") == 0) opts->binary_files_type = 2;
+            } else if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--threads") == 0 || strncmp(argv[i], "--threads=", 10) == 0) {
+                const char *arg;
+                if (argv[i][1] == '-' && argv[i][9] == '=') {
+                    arg = argv[i] + 10;
+                } else {
+                    i++;
+                    if (i >= argc) {
+                        fprintf(stderr, "grep: option requires an argument -- '%s'\n", argv[i - 1][1] == '-' ? "--threads" : "j");
+                        return 1;
+                    }
+                    arg = argv[i];
+                }
+                char *end;
+                long n = strtol(arg, &end, 10);
+                if (end == arg || *end || n < 0 || n > 1024) {
+                    fprintf(stderr, "grep: invalid number of threads: '%s'\n", arg);
+                    return 1;
+                }
+                opts->threads = (int)n;
+            } else if (strcmp(argv[i], "--sort") == 0 || strncmp(argv[i], "--sort=", 7) == 0) {
+                const char *arg;
+                if (argv[i][6] == '=') {
+                    arg = argv[i] + 7;
+                } else {
+                    i++;
+                    if (i >= argc) {
+                        fprintf(stderr, "grep: option requires an argument -- '--sort'\n");
+                        return 1;
+                    }
+                    arg = argv[i];
+                }
+                if (strcmp(arg, "path") == 0) opts->sort_path = 1;
+                else if (strcmp(arg, "none") == 0) opts->sort_path = 0;
+                else {
+                    fprintf(stderr, "grep: invalid argument '%s' for '--sort'\n", arg);
+                    return 1;
+                }
             } else if (strcmp(argv[i], "--") == 0) {
                 i++;
                 break;
             } else {
-                fprintf(stderr, "grep: invalid option -- '%s'\n", argv[i]);
-                return 1;
+                fprintf(stderr, "grep: invalid option -- '%s'\n", argv[i]);
+                return 1;
+            }
+        } else {
+            break;
+        }
+        i++;
+    }
+
+    // Building an index takes no pattern.
+    if (opts->index_build) {
+        *argi = i;
+        return 0;
+    }
+
+    if (opts->num_patterns == 0 && opts->pattern_file == NULL) {
+        if (i >= argc) {
+            print_usage();
+            return 1;
+        }
+        add_patterns(opts, argv[i], strlen(argv[i]));
+        i++;
+    }
+
+    // Load patterns from file if specified
+    if (opts->pattern_file) {
+        FILE *fp = fopen(opts->pattern_file, "rb");
+        if (!fp) {
+            perror("fopen");
+            return 1;
+        }
+        size_t size = 0;
+        size_t capacity = BLOCK_SIZE;
+        char *text = malloc(capacity);
+        size_t n;
+        while ((n = fread(text + size, 1, capacity - size, fp)) > 0) {
+            size += n;
+            if (size == capacity) {
+                capacity *= 2;
+                text = realloc(text, capacity);
+            }
+        }
+        fclose(fp);
+        if (size > 0) {
+            if (text[size-1] == '\n') size--;
+            add_patterns(opts, text, size);
+        }
+    }
+
+    // With no patterns at all (an empty -f file) nothing can match.
+    if (opts->num_patterns == 0) opts->pattern_type = 2;
+
+    if (opts->pattern_type == 2) {
+        opts->fixed_set = literal_set_new((const char **)opts->patterns, opts->pattern_lens, opts->num_patterns, opts->ignore_case);
+    } else if (opts->pattern_type == 3) {
+        if (compile_perl(opts)) return 1;
+    } else if (compile_posix(opts)) {
+        return 1;
+    }
+
+    *argi = i;
+    return 0;
+}
+
+// State for a fixed-string search over [start, end), where start is the
+// beginning of a line.
+typedef struct {
+    Options *opts;
+    const char *start;
+    const char *end;
+    char eol;
+    const char *found;
+    size_t found_len;
+} FixedSearch;
+
+int fixed_occurrence_ok(FixedSearch *fs, const char *pos, size_t pat_len) {
+    Options *opts = fs->opts;
+    // An empty match just past the final terminator is not on any line.
+    if (pos == fs->end && pos > fs->start && pos[-1] == fs->eol) return 0;
+    if (opts->line_regexp) {
+        size_t len;
+        const char *line = line_begin(fs->start, pos, fs->eol);
+        line_next(line, fs->end, fs->eol, &len);
+        return pos == line && pat_len == len;
+    }
+    if (opts->word_regexp) {
+        int start_ok = pos == fs->start || !is_word_char(pos[-1]);
+        int end_ok = pos + pat_len == fs->end || !is_word_char(pos[pat_len]);
+        return start_ok && end_ok;
+    }
+    return 1;
+}
+
+// Occurrence callback that stops at the first acceptable occurrence.
+int first_fixed_occurrence(void *ctx, const char *pos, size_t len, int id) {
+    FixedSearch *fs = ctx;
+    if (!fixed_occurrence_ok(fs, pos, len)) return 0;
+    fs->found = pos;
+    fs->found_len = len;
+    return 1;
+}
+
+// Occurrence callback that keeps the leftmost-longest acceptable occurrence.
+// It stops once no later occurrence can start at or before the best one.
+int longest_fixed_occurrence(void *ctx, const char *pos, size_t len, int id) {
+    FixedSearch *fs = ctx;
+    if (fs->found && pos > fs->found && pos + len > fs->found + fs->opts->fixed_set->max_len) return 1;
+    if (!fixed_occurrence_ok(fs, pos, len)) return 0;
+    if (!fs->found || pos < fs->found || (pos == fs->found && len > fs->found_len)) {
+        fs->found = pos;
+        fs->found_len = len;
+    }
+    return 0;
+}
+
+int match_line(Options *opts, const char *line, size_t len) {
+    if (opts->engine == ENGINE_PCRE) {
+        size_t start, end;
+        return regex_search(opts, line, len, 0, &start, &end);
+    } else if (opts->engine == ENGINE_DFA) {
+        return dfa_match_line(opts->regex->search, line, len);
+    } else {
+        FixedSearch fs = { opts, line, line + len, opts->null_data ? '\0' : '\n', NULL, 0 };
+        literal_set_scan(opts->fixed_set, line, line + len, first_fixed_occurrence, &fs);
+        return fs.found != NULL;
+    }
+}
+
+typedef struct {
+    char *text;
+    size_t len;
+    size_t cap;
+    long long line_no;
+    long long byte_offset;
+    long long end_offset;
+} ContextLine;
+
+// Output text collected in memory.  A file searched alongside others
+// keeps its output in one until the file is done, unless spill decides to
+// send it to stdout early; from then on direct is set and the rest goes
+// straight to stdout.  stdout itself is written through stdout_buf, which
+// spill flushes in batches.
+typedef struct OutBuf {
+    char *data;
+    size_t len;
+    size_t cap;
+    int direct;
+    size_t spill_at;
+    void (*spill)(struct OutBuf *ob);
+    void *ctx;
+    // The group separator, when the collected output opens with a context
+    // group that has yet to be placed after the groups of other files.
+    const char *group_sep;
+} OutBuf;
+
+#define OUTPUT_SPILL_SIZE (1024 * 1024)
+#define OUTPUT_BATCH_SIZE (64 * 1024)
+
+OutBuf stdout_buf;
+int stdout_line_buffered;
+// Whether some file has printed a context group, so the first group of the
+// next one follows a separator.
+int context_group_printed;
+
+void stdout_flush(void) {
+    if (stdout_buf.len > 0) fwrite(stdout_buf.data, 1, stdout_buf.len, stdout);
+    stdout_buf.len = 0;
+    fflush(stdout);
+}
+
+void stdout_spill(OutBuf *ob) {
+    stdout_flush();
+}
+
+void outbuf_write(OutBuf *ob, const void *data, size_t len);
+
+// Large pieces bypass the batch buffer.
+void stdout_write(const void *data, size_t len) {
+    if (len >= OUTPUT_BATCH_SIZE) {
+        stdout_flush();
+        fwrite(data, 1, len, stdout);
+        return;
+    }
+    outbuf_write(&stdout_buf, data, len);
+}
+
+// Complete lines were written to stdout_buf; under --line-buffered, or
+// when stdout is a terminal, they are flushed now.
+void stdout_lines_done(void) {
+    if (stdout_line_buffered) stdout_flush();
+}
+
+void output_init(int line_buffered) {
+    stdout_buf.cap = OUTPUT_BATCH_SIZE;
+    stdout_buf.data = malloc(stdout_buf.cap);
+    stdout_buf.spill = stdout_spill;
+    stdout_buf.spill_at = OUTPUT_BATCH_SIZE;
+    stdout_line_buffered = line_buffered || _isatty(_fileno(stdout));
+}
+
+LONG atomic_read(volatile LONG *p) {
+    return InterlockedCompareExchange(p, 0, 0);
+}
+
+// Set once -q has seen a selected line: the exit status is decided and
+// nothing else is read.
+volatile LONG search_stopped;
+
+void stop_search(void) {
+    InterlockedExchange(&search_stopped, 1);
+}
+
+int search_is_stopped(void) {
+    return atomic_read(&search_stopped) != 0;
+}
+
+// Per-file search state.  Lines are matched in place as blocks are read;
+// only the last before_context lines are copied so they can still be
+// printed once a later line matches.
+typedef struct {
+    Options *opts;
+    const char *filename;
+    size_t filename_len;
+    int print_filename;
+    char eol;
+    long long line_no;
+    long long offset;
+    long long match_count;
+    long long last_printed_end;
+    int after_left;
+    ContextLine *ring;
+    int ring_size;
+    int ring_start;
+    int ring_count;
+    int found;
+    int done;
+    int binary;
+    OutBuf *out;
+    // opts->buffer_code, or NULL when the current buffer needs the
+    // per-line search.
+    pcre2_code *buffer_code;
+    // The first match on span_line, when selecting it found one.
+    const char *span_line;
+    size_t span_start;
+    size_t span_end;
+} SearchState;
+
+// out is NULL to write to stdout as the search goes.
+void search_init(SearchState *st, Options *opts, const char *filename, int print_filename, OutBuf *out) {
+    memset(st, 0, sizeof(*st));
+    st->opts = opts;
+    st->out = out;
+    st->filename = filename;
+    st->filename_len = strlen(filename);
+    st->print_filename = print_filename;
+    st->eol = opts->null_data ? '\0' : '\n';
+    st->last_printed_end = -1;
+    st->ring_size = opts->before_context;
+    if (st->ring_size > 0) {
+        st->ring = calloc(st->ring_size, sizeof(ContextLine));
+    }
+    st->done = opts->max_count == 0;
+}
+
+void search_free(SearchState *st) {
+    for (int i = 0; i < st->ring_size; i++) {
+        free(st->ring[i].text);
+    }
+    free(st->ring);
+}
+
+void outbuf_write(OutBuf *ob, const void *data, size_t len) {
+    if (ob->direct) {
+        stdout_write(data, len);
+        return;
+    }
+    if (ob->len + len > ob->cap) {
+        if (!ob->cap) ob->cap = 4096;
+        while (ob->len + len > ob->cap) ob->cap *= 2;
+        ob->data = realloc(ob->data, ob->cap);
+    }
+    memcpy(ob->data + ob->len, data, len);
+    ob->len += len;
+    if (ob->spill && ob->len >= ob->spill_at) ob->spill(ob);
+}
+
+// Write the output collected for one file to stdout.  group_sep is set when
+// it opens with a context group, which goes after a separator if another
+// file printed a group before.
+void stdout_write_file(const char *group_sep, const void *data, size_t len) {
+    if (group_sep && len > 0) {
+        if (context_group_printed) {
+            stdout_write(group_sep, strlen(group_sep));
+            stdout_write("\n", 1);
+        }
+        context_group_printed = 1;
+    }
+    stdout_write(data, len);
+}
+
+void out_write(SearchState *st, const void *data, size_t len) {
+    outbuf_write(st->out ? st->out : &stdout_buf, data, len);
+}
+
+void out_putc(SearchState *st, char c) {
+    OutBuf *ob = st->out && !st->out->direct ? st->out : &stdout_buf;
+    if (ob->len + 1 < ob->cap && (!ob->spill || ob->len + 1 < ob->spill_at)) {
+        ob->data[ob->len++] = c;
+        return;
+    }
+    outbuf_write(ob, &c, 1);
+}
+
+void out_puts(SearchState *st, const char *s) {
+    out_write(st, s, strlen(s));
+}
+
+// Write n and then sep, without going through printf.
+void out_number(SearchState *st, long long n, char sep) {
+    char buf[24];
+    char *p = buf + sizeof(buf);
+    unsigned long long u = n < 0 ? 0 - (unsigned long long)n : (unsigned long long)n;
+    *--p = sep;
+    do {
+        *--p = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (n < 0) *--p = '-';
+    out_write(st, p, buf + sizeof(buf) - p);
+}
+
+// Terminate an output line.
+void out_end_line(SearchState *st, char eol) {
+    out_putc(st, eol);
+    if (!st->out || st->out->direct) stdout_lines_done();
+}
+
+void out_printf(SearchState *st, const char *fmt, ...) {
+    char buf[128];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n < sizeof(buf)) {
+        out_write(st, buf, n);
+        return;
+    }
+    char *big = malloc(n + 1);
+    va_start(ap, fmt);
+    vsnprintf(big, n + 1, fmt, ap);
+    va_end(ap);
+    out_write(st, big, n);
+    free(big);
+}
+
+void print_line_prefix(SearchState *st, long long line_no, long long byte_offset, char sep) {
+    Options *opts = st->opts;
+    if (st->print_filename) {
+        out_write(st, st->filename, st->filename_len);
+        out_putc(st, opts->null_output ? '\0' : sep);
+    }
+    if (opts->line_number) {
+        out_number(st, line_no, sep);
+    }
+    if (opts->byte_offset) {
+        out_number(st, byte_offset, sep);
+    }
+}
+
+// Find the next match on the line text that starts at or after offset.
+// The first match of a line whose selection found it is not searched for
+// again.
+int next_match(SearchState *st, const char *text, size_t len, size_t offset, size_t *start, size_t *end) {
+    Options *opts = st->opts;
+    if (offset == 0 && st->span_line == text) {
+        *start = st->span_start;
+        *end = st->span_end;
+        return 1;
+    }
+    if (opts->engine == ENGINE_PCRE) {
+        return regex_search(opts, text, len, offset, start, end);
+    } else if (opts->engine == ENGINE_DFA) {
+        return regex_next_match(opts->regex, text, len, offset, start, end);
+    }
+    FixedSearch fs = { opts, text, text + len, st->eol, NULL, 0 };
+    literal_set_scan(opts->fixed_set, text + offset, fs.end, longest_fixed_occurrence, &fs);
+    if (!fs.found) return 0;
+    *start = fs.found - text;
+    *end = *start + fs.found_len;
+    return 1;
+}
+
+void out_match(SearchState *st, const char *text, size_t len) {
+    if (st->opts->color) out_write(st, "\33[01;31m", 8);
+    out_write(st, text, len);
+    if (st->opts->color) out_write(st, "\33[0m", 4);
+}
+
+// Write a selected line with each match highlighted.
+void out_colored_line(SearchState *st, const char *text, size_t len) {
+    size_t offset = 0, printed = 0, start, end;
+    while (offset <= len && next_match(st, text, len, offset, &start, &end)) {
+        if (end > start) {
+            out_write(st, text + printed, start - printed);
+            out_match(st, text + start, end - start);
+            printed = end;
+        }
+        offset = end > start ? end : end + 1;
+    }
+    out_write(st, text + printed, len - printed);
+}
+
+// The first context group of a file is separated from the groups of the
+// files before it.  Output collected in a buffer only learns what came
+// before once it is written out, so the buffer is marked instead.
+void out_first_group(SearchState *st) {
+    OutBuf *ob = st->out;
+    if (ob && !ob->direct && ob->len == 0) {
+        ob->group_sep = st->opts->group_separator;
+        return;
+    }
+    if (context_group_printed || (ob && !ob->direct)) {
+        out_puts(st, st->opts->group_separator);
+        out_end_line(st, '\n');
+    }
+    context_group_printed = 1;
+}
+
+void print_line(SearchState *st, const char *text, size_t len, long long line_no, long long byte_offset, long long end_offset, int selected) {
+    Options *opts = st->opts;
+    int has_context = opts->before_context > 0 || opts->after_context > 0;
+    if (has_context && !opts->no_group_separator && st->last_printed_end < 0) {
+        out_first_group(st);
+    } else if (has_context && !opts->no_group_separator && byte_offset != st->last_printed_end) {
+        out_puts(st, opts->group_separator);
+        out_end_line(st, '\n');
+    }
+    print_line_prefix(st, line_no, byte_offset, selected ? ':' : '-');
+    // Under -v the selected lines hold no match.
+    if (opts->color && selected && !opts->invert_match) {
+        out_colored_line(st, text, len);
+    } else {
+        out_write(st, text, len);
+    }
+    out_end_line(st, opts->null_data ? '\0' : '\n');
+    st->last_printed_end = end_offset;
+    st->found = 1;
+}
+
+void print_only_matching(SearchState *st, const char *text, size_t len, long long line_no, long long byte_offset) {
+    Options *opts = st->opts;
+    size_t offset = 0, start, end;
+    while (offset <= len && next_match(st, text, len, offset, &start, &end)) {
+        if (end > start) {
+            print_line_prefix(st, line_no, byte_offset + start, ':');
+            out_match(st, text + start, end - start);
+            out_end_line(st, opts->null_data ? '\0' : '\n');
+            st->found = 1;
+        }
+        offset = end > start ? end : end + 1;
+    }
+}
+
+void remember_context(SearchState *st, const char *text, size_t len, long long end_offset) {
+    int slot = (st->ring_start + st->ring_count) % st->ring_size;
+    if (st->ring_count == st->ring_size) {
+        st->ring_start = (st->ring_start + 1) % st->ring_size;
+    } else {
+        st->ring_count++;
+    }
+    ContextLine *cl = &st->ring[slot];
+    if (cl->cap < len + 1) {
+        cl->cap = len + 1;
+        cl->text = realloc(cl->text, cl->cap);
+    }
+    memcpy(cl->text, text, len);
+    cl->len = len;
+    cl->line_no = st->line_no;
+    cl->byte_offset = st->offset;
+    cl->end_offset = end_offset;
+}
+
+void flush_context(SearchState *st) {
+    for (int i = 0; i < st->ring_count; i++) {
+        ContextLine *cl = &st->ring[(st->ring_start + i) % st->ring_size];
+        print_line(st, cl->text, cl->len, cl->line_no, cl->byte_offset, cl->end_offset, 0);
+    }
+    st->ring_start = 0;
+    st->ring_count = 0;
+}
+
+int search_has_output(SearchState *st) {
+    Options *opts = st->opts;
+    return !opts->list_files && !opts->files_without_match && !opts->count && !opts->quiet;
+}
+
+int max_count_reached(SearchState *st) {
+    return st->opts->max_count != -1 && st->match_count >= st->opts->max_count;
+}
+
+// Consume the selected line [line, next).  Sets done once the rest of
+// the file can no longer change what is printed or the exit status.
+void select_line(SearchState *st, const char *line, const char *next) {
+    Options *opts = st->opts;
+    size_t len;
+    line_next(line, next, st->eol, &len);
+    st->line_no++;
+    long long end_offset = st->offset + (next - line);
+    if (max_count_reached(st)) {
+        // Past -m, a selected line can only be trailing context.
+        if (st->after_left > 0) {
+            st->after_left--;
+            print_line(st, line, len, st->line_no, st->offset, end_offset, 0);
+        }
+        st->offset += next - line;
+        st->done = st->after_left == 0;
+        return;
+    }
+    st->match_count++;
+    if (st->binary && search_has_output(st)) {
+        // The lines of a binary file are not printed, only that it matches.
+        fprintf(stderr, "grep: %s: binary file matches\n", st->filename);
+        st->done = 1;
+        return;
+    }
+    if (search_has_output(st)) {
+        if (opts->only_matching) {
+            if (!opts->invert_match) {
+                print_only_matching(st, line, len, st->line_no, st->offset);
+            }
+        } else {
+            flush_context(st);
+            print_line(st, line, len, st->line_no, st->offset, end_offset, 1);
+        }
+        st->after_left = opts->after_context;
+    }
+    st->span_line = NULL;
+    st->offset += next - line;
+    if (opts->quiet) {
+        stop_search();
+        st->done = 1;
+    } else if (opts->list_files || opts->files_without_match) {
+        st->done = 1;
+    } else if (max_count_reached(st) && st->after_left == 0) {
+        st->done = 1;
+    }
+}
+
+// Consume the lines in [from, to), none of which is selected.  Only the
+// first after_context of them and the last before_context of them can be
+// printed, so everything in between is skipped without looking at it.
+void skip_lines(SearchState *st, const char *from, const char *to) {
+    size_t len;
+    int output = search_has_output(st);
+    while (output && st->after_left > 0 && from < to) {
+        const char *next = line_next(from, to, st->eol, &len);
+        st->line_no++;
+        st->after_left--;
+        print_line(st, from, len, st->line_no, st->offset, st->offset + (next - from), 0);
+        st->offset += next - from;
+        from = next;
+    }
+    if (st->after_left == 0 && max_count_reached(st)) {
+        st->done = 1;
+        return;
+    }
+    if (from >= to) return;
+    const char *tail = to;
+    if (output && st->ring_size > 0) {
+        for (int n = 0; n < st->ring_size && tail > from; n++) {
+            tail = line_begin(from, tail - 1, st->eol);
+        }
+    }
+    // Line numbers are only counted when they are printed; byte offsets
+    // come from the buffer positions.
+    if (st->opts->line_number) st->line_no += count_lines(from, tail, st->eol);
+    st->offset += tail - from;
+    while (tail < to) {
+        const char *next = line_next(tail, to, st->eol, &len);
+        st->line_no++;
+        remember_context(st, tail, len, st->offset + (next - tail));
+        st->offset += next - tail;
+        tail = next;
+    }
+}
+
+int first_literal_occurrence(void *ctx, const char *pos, size_t len, int id) {
+    FixedSearch *fs = ctx;
+    fs->found = pos;
+    return 1;
+}
+
+// Whether the -P programs match line.  The match found is kept for -o and
+// --color.
+int regex_select(SearchState *st, const char *line, size_t len) {
+    size_t start, end;
+    if (!regex_search(st->opts, line, len, 0, &start, &end)) return 0;
+    st->span_line = line;
+    st->span_start = start;
+    st->span_end = end;
+    return 1;
+}
+
+// Find the first line in [start, end) that matches.  The whole buffer is
+// handed to the matcher at once and line boundaries are only located
+// around the hits, so lines without a match cost nothing per line.
+const char *find_matching_line(SearchState *st, const char *start, const char *end) {
+    Options *opts = st->opts;
+    size_t len;
+    st->span_line = NULL;
+    if (opts->engine != ENGINE_FIXED) {
+        if (opts->literal_set) {
+            // Only lines holding one of the required literals can match.
+            const char *from = start;
+            while (start < end) {
+                FixedSearch fs = { opts, start, end, st->eol, NULL, 0 };
+                literal_set_scan(opts->literal_set, start, end, first_literal_occurrence, &fs);
+                const char *pos = fs.found;
+                if (!pos) return NULL;
+                const char *line = line_begin(start, pos, st->eol);
+                // A literal on line after line is too common to save any
+                // work, so the DFA takes the rest of the buffer.
+                if (opts->engine == ENGINE_DFA && line == start && start > from) break;
+                const char *next = line_next(line, end, st->eol, &len);
+                if (opts->engine == ENGINE_DFA) {
+                    int verify;
+                    if (dfa_find_line(opts->regex->search, line, next, st->eol, &verify) && (!verify || match_line(opts, line, len))) return line;
+                } else if (regex_select(st, line, len)) {
+                    return line;
+                }
+                start = next;
+            }
+            if (start >= end) return NULL;
+        }
+        if (opts->engine == ENGINE_DFA) {
+            while (start < end) {
+                int verify;
+                const char *line = dfa_find_line(opts->regex->search, start, end, st->eol, &verify);
+                if (!line) return NULL;
+                const char *next = line_next(line, end, st->eol, &len);
+                if (!verify || match_line(opts, line, len)) return line;
+                start = next;
+            }
+            return NULL;
+        }
+        if (!st->buffer_code) {
+            while (start < end) {
+                const char *next = line_next(start, end, st->eol, &len);
+                if (regex_select(st, start, len)) return start;
+                start = next;
+            }
+            return NULL;
+        }
+        PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(opts->match_data);
+        while (start < end) {
+            if (regex_match(opts, st->buffer_code, start, end - start, 0) <= 0) return NULL;
+            // The hit may extend past its line, so confirm it on the line alone.
+            const char *line = line_begin(start, start + ovector[0], st->eol);
+            const char *next = line_next(line, end, st->eol, &len);
+            if (regex_select(st, line, len)) return line;
+            start = next;
+        }
+        return NULL;
+    }
+
+    FixedSearch fs = { opts, start, end, st->eol, NULL, 0 };
+    literal_set_scan(opts->fixed_set, start, end, first_fixed_occurrence, &fs);
+    if (!fs.found) return NULL;
+    const char *line = line_begin(start, fs.found, st->eol);
+    // With one string the first occurrence is also the longest there.
+    if (opts->fixed_set->count == 1) {
+        st->span_line = line;
+        st->span_start = fs.found - line;
+        st->span_end = st->span_start + fs.found_len;
+    }
+    return line;
+}
+
+// Search the complete lines in buf.  Returns the number of bytes consumed;
+// an incomplete trailing line is left for the next block unless this is
+// the last block.
+size_t search_buffer(SearchState *st, const char *buf, size_t size, int eof) {
+    Options *opts = st->opts;
+    const char *end = buf + size;
+    if (!eof) {
+        const char *last = mem_rchr(buf, st->eol, size);
+        if (!last) return 0;
+        end = last + 1;
+    }
+    // Lines are matched without their trailing CRs, but in the buffer a
+    // $ cannot match before a CR.
+    st->buffer_code = opts->buffer_code;
+    if (opts->buffer_dollar && memchr(buf, '\r', size)) st->buffer_code = NULL;
+    const char *p = buf;
+    while (p < end && !st->done) {
+        const char *match = find_matching_line(st, p, end);
+        const char *stop = match ? match : end;
+        if (opts->invert_match) {
+            while (p < stop && !st->done) {
+                size_t len;
+                const char *next = line_next(p, stop, st->eol, &len);
+                select_line(st, p, next);
+                p = next;
+            }
+        } else {
+            skip_lines(st, p, stop);
+        }
+        if (!match || st->done) break;
+        size_t len;
+        const char *next = line_next(match, end, st->eol, &len);
+        if (opts->invert_match) {
+            skip_lines(st, match, next);
+        } else {
+            select_line(st, match, next);
+        }
+        p = next;
+    }
+    return end - buf;
+}
+
+void search_finish(SearchState *st) {
+    Options *opts = st->opts;
+    if (opts->list_files) {
+        if (st->match_count > 0 && !opts->quiet) {
+            out_write(st, st->filename, st->filename_len);
+            out_end_line(st, opts->null_output ? '\0' : '\n');
+        }
+    } else if (opts->files_without_match) {
+        if (st->match_count == 0 && !opts->quiet) {
+            out_write(st, st->filename, st->filename_len);
+            out_end_line(st, opts->null_output ? '\0' : '\n');
+        }
+    } else if (opts->count) {
+        if (!opts->quiet) {
+            if (st->print_filename) {
+                out_write(st, st->filename, st->filename_len);
+                out_putc(st, opts->null_output ? '\0' : ':');
+            }
+            out_printf(st, "%lld", st->match_count);
+            out_end_line(st, '\n');
+        }
+    }
+    // Like GNU grep, the exit status reflects whether any line was selected.
+    st->found = st->match_count > 0;
+}
+
+// Files at least this large are memory-mapped and searched in place;
+// smaller files are cheaper to read into the block buffer.
+#define MMAP_MIN_SIZE (64 * 1024)
+
+typedef struct {
+    HANDLE file;
+    HANDLE mapping;
+    const char *data;
+    size_t size;
+} MappedFile;
+
+// Map the file open as file read-only, taking over the handle.  Returns 0
+// when the file is not suitable for mapping (pipes, devices, small or
+// empty files) or the mapping fails, in which case the handle is closed
+// and the caller falls back to buffered reads.
+int map_handle(HANDLE file, MappedFile *mf) {
+    memset(mf, 0, sizeof(*mf));
+    mf->file = file;
+    LARGE_INTEGER size;
+    if (GetFileType(mf->file) != FILE_TYPE_DISK || !GetFileSizeEx(mf->file, &size) ||
+        size.QuadPart < MMAP_MIN_SIZE || (unsigned long long)size.QuadPart > (size_t)-1) {
+        CloseHandle(mf->file);
+        return 0;
+    }
+    mf->mapping = CreateFileMappingA(mf->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mf->mapping) {
+        CloseHandle(mf->file);
+        return 0;
+    }
+    mf->data = MapViewOfFile(mf->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!mf->data) {
+        CloseHandle(mf->mapping);
+        CloseHandle(mf->file);
+        return 0;
+    }
+    mf->size = (size_t)size.QuadPart;
+    return 1;
+}
+
+// Map a regular file read-only, as map_handle does.
+int map_file(const char *filename, MappedFile *mf) {
+    memset(mf, 0, sizeof(*mf));
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) return 0;
+    return map_handle(file, mf);
+}
+
+void unmap_file(MappedFile *mf) {
+    UnmapViewOfFile(mf->data);
+    CloseHandle(mf->mapping);
+    CloseHandle(mf->file);
+}
+
+// Binary files are recognized by their first BINARY_SNIFF_SIZE bytes.
+#define BINARY_SNIFF_SIZE (32 * 1024)
+
+// Whether a file starting with buf is binary: it has a NUL byte there, or
+// a UTF-16 or UTF-32 byte order mark.  Under -z NUL ends lines, so only
+// the byte order mark counts.
+int buffer_is_binary(Options *opts, const char *buf, size_t len) {
+    if (opts->binary_files_type == 1) return 0;
+    const unsigned char *u = (const unsigned char *)buf;
+    if (len >= 2 && ((u[0] == 0xFF && u[1] == 0xFE) || (u[0] == 0xFE && u[1] == 0xFF))) return 1;
+    if (len >= 4 && u[0] == 0 && u[1] == 0 && u[2] == 0xFE && u[3] == 0xFF) return 1;
+    if (opts->null_data) return 0;
+    return count_byte_kernel(buf, len < BINARY_SNIFF_SIZE ? len : BINARY_SNIFF_SIZE, '\0') > 0;
+}
+
+// Look at the first block of the file being searched.  Returns 0 if the
+// file is binary and -I skips it, in which case it counts as having no
+// selected line.
+int search_first_block(SearchState *st, const char *buf, size_t len) {
+    st->binary = buffer_is_binary(st->opts, buf, len);
+    return !st->binary || st->opts->binary_files_type != 2;
+}
+
+// Whether the search printed "binary file matches" instead of lines.
+int search_reported_binary(SearchState *st) {
+    return st->binary && st->match_count > 0 && search_has_output(st);
+}
+
+// Reads up to len bytes into buf, like _read.
+typedef int (*ReadFn)(void *ctx, char *buf, unsigned len);
+
+int read_fd(void *ctx, char *buf, unsigned len) {
+    return _read(*(int *)ctx, buf, len);
+}
+
+// Read in blocks and search complete lines in place, one read per block.
+// A read returns what a pipe has so far, so lines fed slowly are still
+// searched as they come.  A line longer than the buffer makes it grow, so
+// there is no line length limit.
+void search_stream(SearchState *st, ReadFn read, void *ctx) {
+    size_t capacity = BLOCK_SIZE;
+    size_t used = 0;
+    char *buffer = malloc(capacity);
+    if (!buffer) {
+        perror("malloc");
+        return;
+    }
+    int first = 1;
+    while (1) {
+        if (used == capacity) {
+            capacity *= 2;
+            char *grown = realloc(buffer, capacity);
+            if (!grown) {
+                perror("realloc");
+                break;
+            }
+            buffer = grown;
+        }
+        size_t want = capacity - used;
+        int n = read(ctx, buffer + used, want > (1u << 30) ? 1u << 30 : (unsigned)want);
+        if (n < 0) {
+            if (!st->opts->no_messages) perror(st->filename);
+            n = 0;
+        }
+        used += n;
+        if (first) {
+            first = 0;
+            if (!search_first_block(st, buffer, used)) break;
+        }
+        int eof = n == 0;
+        size_t consumed = search_buffer(st, buffer, used, eof);
+        memmove(buffer, buffer + consumed, used - consumed);
+        used -= consumed;
+        if (eof || st->done || search_is_stopped()) break;
+    }
+    free(buffer);
+}
+
+// --decompress.  A gzip or zstd file is inflated by a thread of its own
+// into DECOMPRESS_BLOCK blocks, which it hands to the search through a
+// queue of at most DECOMPRESS_QUEUE of them, so inflating and matching
+// run side by side.
+#define DECOMPRESS_BLOCK (256 * 1024)
+#define DECOMPRESS_INPUT (64 * 1024)
+#define DECOMPRESS_QUEUE 4
+
+#define COMPRESS_NONE 0
+#define COMPRESS_GZIP 1
+#define COMPRESS_ZSTD 2
+
+// Recognize compressed data by its magic bytes.
+int compression_kind(const char *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    if (len >= 2 && p[0] == 0x1F && p[1] == 0x8B) return COMPRESS_GZIP;
+    if (len >= 4 && p[0] == 0x28 && p[1] == 0xB5 && p[2] == 0x2F && p[3] == 0xFD) return COMPRESS_ZSTD;
+    return COMPRESS_NONE;
+}
+
+int file_compression_kind(const char *filename) {
+    char magic[4];
+    int fd = _open(filename, _O_RDONLY | _O_BINARY);
+    if (fd < 0) return COMPRESS_NONE;
+    int n = _read(fd, magic, sizeof(magic));
+    _close(fd);
+    return n > 0 ? compression_kind(magic, n) : COMPRESS_NONE;
+}
+
+typedef struct {
+    const char *filename;
+    Options *opts;
+    int fd;
+    int kind;
+    char *blocks[DECOMPRESS_QUEUE];
+    size_t lens[DECOMPRESS_QUEUE];
+    int head;
+    int count;
+    size_t offset;
+    int finished;
+    int cancelled;
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE not_empty;
+    CONDITION_VARIABLE not_full;
+} Decompressor;
+
+// Queue a block of len bytes, waiting for room.  Returns 0, having freed
+// the block, if the search no longer wants it.
+int decompress_put(Decompressor *d, char *block, size_t len) {
+    EnterCriticalSection(&d->lock);
+    while (d->count == DECOMPRESS_QUEUE && !d->cancelled) SleepConditionVariableCS(&d->not_full, &d->lock, INFINITE);
+    int cancelled = d->cancelled;
+    if (!cancelled) {
+        int tail = (d->head + d->count) % DECOMPRESS_QUEUE;
+        d->blocks[tail] = block;
+        d->lens[tail] = len;
+        d->count++;
+        WakeConditionVariable(&d->not_empty);
+    }
+    LeaveCriticalSection(&d->lock);
+    if (cancelled) free(block);
+    return !cancelled;
+}
+
+// Inflate every gzip member of the file.  Returns 0 on corrupt data, 1
+// otherwise, including when the search stopped early.
+int inflate_gzip(Decompressor *d, unsigned char *in, char **block) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (inflateInit2(&z, 15 + 32) != Z_OK) return 0;
+    z.next_out = (Bytef *)*block;
+    z.avail_out = DECOMPRESS_BLOCK;
+    int ret = Z_OK, full = 0, ok = 1;
+    while (1) {
+        // Input is only read once inflate has written all it can of the
+        // last, which a full output block may have cut short.
+        if (z.avail_in == 0 && !full) {
+            int n = _read(d->fd, in, DECOMPRESS_INPUT);
+            if (n <= 0) {
+                ok = n == 0 && ret == Z_STREAM_END;
+                break;
+            }
+            z.next_in = in;
+            z.avail_in = n;
+        }
+        // Another member follows the one that ended.
+        if (ret == Z_STREAM_END && z.avail_in > 0) inflateReset(&z);
+        ret = inflate(&z, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            ok = 0;
+            break;
+        }
+        full = z.avail_out == 0;
+        if (full) {
+            if (!decompress_put(d, *block, DECOMPRESS_BLOCK)) {
+                *block = NULL;
+                break;
+            }
+            *block = malloc(DECOMPRESS_BLOCK);
+            z.next_out = (Bytef *)*block;
+            z.avail_out = DECOMPRESS_BLOCK;
+        }
+    }
+    if (*block && z.avail_out < DECOMPRESS_BLOCK && decompress_put(d, *block, DECOMPRESS_BLOCK - z.avail_out)) *block = NULL;
+    inflateEnd(&z);
+    return ok;
+}
+
+// Decompress every zstd frame of the file, as inflate_gzip does.
+int inflate_zstd(Decompressor *d, unsigned char *in, char **block) {
+    ZSTD_DStream *z = ZSTD_createDStream();
+    if (!z) return 0;
+    ZSTD_inBuffer input = { in, 0, 0 };
+    ZSTD_outBuffer output = { *block, DECOMPRESS_BLOCK, 0 };
+    size_t ret = 1;
+    int full = 0, ok = 1;
+    while (1) {
+        if (input.pos == input.size && !full) {
+            int n = _read(d->fd, in, DECOMPRESS_INPUT);
+            if (n <= 0) {
+                // A return of 0 means the last frame was complete.
+                ok = n == 0 && ret == 0;
+                break;
+            }
+            input.size = n;
+            input.pos = 0;
+        }
+        ret = ZSTD_decompressStream(z, &output, &input);
+        if (ZSTD_isError(ret)) {
+            ok = 0;
+            break;
+        }
+        full = output.pos == output.size;
+        if (full) {
+            if (!decompress_put(d, *block, DECOMPRESS_BLOCK)) {
+                *block = NULL;
+                break;
+            }
+            *block = malloc(DECOMPRESS_BLOCK);
+            output.dst = *block;
+            output.pos = 0;
+        }
+    }
+    if (*block && output.pos > 0 && decompress_put(d, *block, output.pos)) *block = NULL;
+    ZSTD_freeDStream(z);
+    return ok;
+}
+
+DWORD WINAPI decompress_main(void *arg) {
+    Decompressor *d = arg;
+    unsigned char *in = malloc(DECOMPRESS_INPUT);
+    char *block = malloc(DECOMPRESS_BLOCK);
+    int ok = d->kind == COMPRESS_GZIP ? inflate_gzip(d, in, &block) : inflate_zstd(d, in, &block);
+    free(block);
+    free(in);
+    EnterCriticalSection(&d->lock);
+    if (!ok && !d->cancelled && !d->opts->no_messages) fprintf(stderr, "grep: %s: invalid compressed data\n", d->filename);
+    d->finished = 1;
+    WakeConditionVariable(&d->not_empty);
+    LeaveCriticalSection(&d->lock);
+    return 0;
+}
+
+// The ReadFn of search_stream for decompressed data.
+int read_decompressed(void *ctx, char *buf, unsigned len) {
+    Decompressor *d = ctx;
+    EnterCriticalSection(&d->lock);
+    while (d->count == 0 && !d->finished) SleepConditionVariableCS(&d->not_empty, &d->lock, INFINITE);
+    char *block = d->count ? d->blocks[d->head] : NULL;
+    size_t left = d->count ? d->lens[d->head] - d->offset : 0;
+    LeaveCriticalSection(&d->lock);
+    if (!block) return 0;
+
+    // Only this thread touches the head block until it is dequeued.
+    if (len > left) len = (unsigned)left;
+    memcpy(buf, block + d->offset, len);
+    d->offset += len;
+    if (len == left) {
+        EnterCriticalSection(&d->lock);
+        d->head = (d->head + 1) % DECOMPRESS_QUEUE;
+        d->count--;
+        d->offset = 0;
+        WakeConditionVariable(&d->not_full);
+        LeaveCriticalSection(&d->lock);
+        free(block);
+    }
+    return (int)len;
+}
+
+// Search the decompressed contents of a compressed file.
+int search_compressed(const char *filename, int kind, Options *opts, int print_filename, OutBuf *out, int *binary) {
+    Decompressor d;
+    memset(&d, 0, sizeof(d));
+    d.filename = filename;
+    d.opts = opts;
+    d.kind = kind;
+    d.fd = _open(filename, _O_RDONLY | _O_BINARY);
+    if (d.fd < 0) {
+        if (!opts->no_messages && errno != 0) perror(filename);
+        return 0;
+    }
+    InitializeCriticalSection(&d.lock);
+    InitializeConditionVariable(&d.not_empty);
+    InitializeConditionVariable(&d.not_full);
+    HANDLE thread = CreateThread(NULL, 0, decompress_main, &d, 0, NULL);
+    if (!thread) {
+        fprintf(stderr, "grep: %s: cannot start decompression\n", filename);
+        DeleteCriticalSection(&d.lock);
+        _close(d.fd);
+        return 0;
+    }
+
+    SearchState st;
+    search_init(&st, opts, filename, print_filename, out);
+    search_stream(&st, read_decompressed, &d);
+
+    // The search may have stopped early: release the producer.
+    EnterCriticalSection(&d.lock);
+    d.cancelled = 1;
+    WakeConditionVariable(&d.not_full);
+    LeaveCriticalSection(&d.lock);
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    for (int i = 0; i < d.count; i++) free(d.blocks[(d.head + i) % DECOMPRESS_QUEUE]);
+    DeleteCriticalSection(&d.lock);
+    _close(d.fd);
+
+    search_finish(&st);
+    search_free(&st);
+    if (binary) *binary = search_reported_binary(&st);
+    return st.found;
+}
+
+// Search a mapped file and unmap it.  binary, unless NULL, is set to
+// whether the file was reported as a matching binary file.
+int search_mapped_file(const char *filename, MappedFile *mf, Options *opts, int print_filename, OutBuf *out,
+                       int *binary) {
+    SearchState st;
+    search_init(&st, opts, filename, print_filename, out);
+    if (search_first_block(&st, mf->data, mf->size)) search_buffer(&st, mf->data, mf->size, 1);
+    unmap_file(mf);
+    search_finish(&st);
+    search_free(&st);
+    if (binary) *binary = search_reported_binary(&st);
+    return st.found;
+}
+
+// Search one file.  Its output goes to out, or to stdout if out is NULL.
+int search_file(const char *filename, Options *opts, int num_files, int print_filename, OutBuf *out, int *binary) {
+    SearchState st;
+    MappedFile mf;
+    if (binary) *binary = 0;
+    if (opts->decompress) {
+        int kind = file_compression_kind(filename);
+        if (kind != COMPRESS_NONE) return search_compressed(filename, kind, opts, print_filename, out, binary);
+    }
+    if (map_file(filename, &mf)) {
+        return search_mapped_file(filename, &mf, opts, print_filename, out, binary);
+    }
+
+    int fd = _open(filename, _O_RDONLY | _O_BINARY);
+    if (fd < 0) {
+        if (!opts->no_messages && errno != 0) perror(filename);
+        return 0;
+    }
+
+    search_init(&st, opts, filename, print_filename, out);
+    search_stream(&st, read_fd, &fd);
+    _close(fd);
+
+    search_finish(&st);
+    search_free(&st);
+    if (binary) *binary = search_reported_binary(&st);
+    return st.found;
+}
+
+// What identifies the contents of a regular file without reading them.
+// Times are FILETIME counts of 100 ns.  A file system with coarse
+// timestamps (2 s on FAT) can give a later write the time of an earlier
+// one, so a file written less than FILE_TIME_SLACK before its identity
+// was taken may change without its identity changing.
+#define FILE_TIME_SLACK (2 * 10000000ull)
+
+typedef struct {
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t file_id;
+    uint32_t volume;
+} FileIdentity;
+
+// Returns 0 for anything but a regular file.
+int file_identity(const char *filename, FileIdentity *id) {
+    HANDLE file = CreateFileA(filename, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (file == INVALID_HANDLE_VALUE) return 0;
+    BY_HANDLE_FILE_INFORMATION info;
+    int ok = GetFileType(file) == FILE_TYPE_DISK && GetFileInformationByHandle(file, &info) &&
+             !(info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+    CloseHandle(file);
+    if (!ok) return 0;
+    memset(id, 0, sizeof(*id));
+    id->size = (uint64_t)info.nFileSizeHigh << 32 | info.nFileSizeLow;
+    id->mtime = (uint64_t)info.ftLastWriteTime.dwHighDateTime << 32 | info.ftLastWriteTime.dwLowDateTime;
+    id->file_id = (uint64_t)info.nFileIndexHigh << 32 | info.nFileIndexLow;
+    id->volume = info.dwVolumeSerialNumber;
+    return 1;
+}
+
+int same_file_identity(const FileIdentity *a, const FileIdentity *b) {
+    return a->size == b->size && a->mtime == b->mtime && a->file_id == b->file_id && a->volume == b->volume;
+}
+
+uint64_t current_file_time(void) {
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    return (uint64_t)now.dwHighDateTime << 32 | now.dwLowDateTime;
+}
+
+// --cache.  What searching a file produced -- whether it counts as found,
+// its output and whether it was reported as a binary file -- is kept under
+// its path and a hash of the options that shape output, and is reused
+// while the size, modification time and file ID of the file are unchanged.
+// The cache file is read whole at startup and written back at exit.
+#define CACHE_MAGIC "GRPCCH1\n"
+#define CACHE_MAX_OUTPUT (256 * 1024)
+// Runs that may go by without using an entry before it is dropped.
+#define CACHE_MAX_AGE 64
+
+#define CACHE_FOUND 1
+#define CACHE_BINARY 2
+// The output opens with a context group.
+#define CACHE_GROUP 4
+
+typedef struct {
+    uint64_t options;
+    FileIdentity file;
+    uint32_t flags;
+    uint32_t age;
+    uint32_t path_len;
+    uint32_t output_len;
+} CacheRecord;
+
+typedef struct {
+    CacheRecord rec;
+    char *path;
+    char *output;
+    int used;
+} CacheEntry;
+
+struct ResultCache {
+    const char *file;
+    uint64_t options;
+    uint64_t started;
+    CacheEntry *entries;
+    int count;
+    int cap;
+    int *slots;
+    int slots_cap;
+    CRITICAL_SECTION lock;
+};
+
+uint64_t hash_bytes(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) h = (h ^ p[i]) * 1099511628211ull;
+    return h;
+}
+
+// A hash of everything that decides what searching a file prints.
+uint64_t cache_options_hash(Options *opts, int print_filename) {
+    int fields[] = {
+        opts->pattern_type, opts->ignore_case, opts->invert_match, opts->line_number, opts->list_files,
+        opts->count, opts->word_regexp, opts->line_regexp, opts->null_data, opts->max_count,
+        opts->byte_offset, opts->only_matching, opts->quiet, opts->binary_files_type,
+        opts->files_without_match, opts->initial_tab, opts->null_output, opts->before_context,
+        opts->after_context, opts->no_group_separator, opts->color, opts->decompress, print_filename,
+    };
+    uint64_t h = hash_bytes(14695981039346656037ull, fields, sizeof(fields));
+    for (int i = 0; i < opts->num_patterns; i++) {
+        uint64_t len = opts->pattern_lens[i];
+        h = hash_bytes(h, &len, sizeof(len));
+        h = hash_bytes(h, opts->patterns[i], opts->pattern_lens[i]);
+    }
+    if (opts->group_separator) h = hash_bytes(h, opts->group_separator, strlen(opts->group_separator) + 1);
+    return h;
+}
+
+unsigned cache_slot_hash(uint64_t options, const char *path) {
+    uint64_t h = hash_bytes(options, path, strlen(path));
+    return (unsigned)(h ^ h >> 32);
+}
+
+void cache_rehash(ResultCache *c) {
+    free(c->slots);
+    c->slots_cap = 16;
+    while (c->slots_cap < c->cap * 2) c->slots_cap *= 2;
+    c->slots = malloc(c->slots_cap * sizeof(int));
+    memset(c->slots, -1, c->slots_cap * sizeof(int));
+    for (int i = 0; i < c->count; i++) {
+        unsigned j = cache_slot_hash(c->entries[i].rec.options, c->entries[i].path) & (c->slots_cap - 1);
+        while (c->slots[j] >= 0) j = (j + 1) & (c->slots_cap - 1);
+        c->slots[j] = i;
+    }
+}
+
+CacheEntry *cache_find(ResultCache *c, uint64_t options, const char *path) {
+    unsigned mask = c->slots_cap - 1;
+    for (unsigned j = cache_slot_hash(options, path) & mask; c->slots[j] >= 0; j = (j + 1) & mask) {
+        CacheEntry *e = &c->entries[c->slots[j]];
+        if (e->rec.options == options && strcmp(e->path, path) == 0) return e;
+    }
+    return NULL;
+}
+
+// Add an entry, which takes over path and output.
+void cache_add(ResultCache *c, CacheRecord *rec, char *path, char *output) {
+    if (c->count == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 64;
+        c->entries = realloc(c->entries, c->cap * sizeof(CacheEntry));
+    }
+    CacheEntry *e = &c->entries[c->count++];
+    e->rec = *rec;
+    e->path = path;
+    e->output = output;
+    e->used = 0;
+    if (c->count * 2 > c->slots_cap) {
+        cache_rehash(c);
+        return;
+    }
+    unsigned j = cache_slot_hash(rec->options, path) & (c->slots_cap - 1);
+    while (c->slots[j] >= 0) j = (j + 1) & (c->slots_cap - 1);
+    c->slots[j] = c->count - 1;
+}
+
+// Open the cache in file for a search with opts.  A missing or corrupt
+// cache file starts an empty cache.
+ResultCache *cache_open(const char *file, Options *opts, int print_filename) {
+    ResultCache *c = calloc(1, sizeof(ResultCache));
+    c->file = file;
+    c->options = cache_options_hash(opts, print_filename);
+    c->started = current_file_time();
+    InitializeCriticalSection(&c->lock);
+    cache_rehash(c);
+
+    FILE *fp = fopen(file, "rb");
+    if (!fp) return c;
+    char magic[8];
+    int valid = fread(magic, 1, 8, fp) == 8 && memcmp(magic, CACHE_MAGIC, 8) == 0;
+    CacheRecord rec;
+    while (valid && fread(&rec, sizeof(rec), 1, fp) == 1) {
+        char *path = malloc((size_t)rec.path_len + 1);
+        char *output = malloc(rec.output_len ? rec.output_len : 1);
+        valid = rec.path_len > 0 && rec.output_len <= CACHE_MAX_OUTPUT && fread(path, 1, rec.path_len, fp) == rec.path_len &&
+                fread(output, 1, rec.output_len, fp) == rec.output_len;
+        if (!valid) {
+            free(path);
+            free(output);
+            break;
+        }
+        path[rec.path_len] = '\0';
+        if (cache_find(c, rec.options, path)) {
+            free(path);
+            free(output);
+            continue;
+        }
+        cache_add(c, &rec, path, output);
+    }
+    if (valid && !feof(fp)) valid = 0;
+    fclose(fp);
+    if (!valid && !opts->no_messages) fprintf(stderr, "grep: %s: invalid cache, ignored\n", file);
+    return c;
+}
+
+// Move the finished file tmp over path in one step, so that a crash or a
+// concurrent grep sees either the old file or the new one.  Sets errno on
+// failure.
+int replace_file(const char *tmp, const char *path) {
+    if (MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING)) return 0;
+    errno = EACCES;
+    return -1;
+}
+
+// Write the cache back.  Entries no run has used for CACHE_MAX_AGE runs,
+// such as those of deleted files, are dropped.  Returns 0 on success.
+int cache_save(ResultCache *c) {
+    char tmp[1040];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", c->file);
+    FILE *fp = fopen(tmp, "wb");
+    int ok = fp != NULL;
+    if (ok) {
+        ok = fwrite(CACHE_MAGIC, 1, 8, fp) == 8;
+        for (int i = 0; i < c->count && ok; i++) {
+            CacheEntry *e = &c->entries[i];
+            e->rec.age = e->used ? 0 : e->rec.age + 1;
+            if (e->rec.age >= CACHE_MAX_AGE) continue;
+            ok = fwrite(&e->rec, sizeof(e->rec), 1, fp) == 1 && fwrite(e->path, 1, e->rec.path_len, fp) == e->rec.path_len &&
+                 fwrite(e->output, 1, e->rec.output_len, fp) == e->rec.output_len;
+        }
+        ok = fclose(fp) == 0 && ok;
+    }
+    if (ok) ok = replace_file(tmp, c->file) == 0;
+    if (!ok) {
+        fprintf(stderr, "grep: %s: %s\n", c->file, strerror(errno));
+        remove(tmp);
+    }
+    return !ok;
+}
+
+// Pass output collected for a file on to out, or to stdout if out is NULL.
+void write_output(OutBuf *out, const char *group_sep, const void *data, size_t len) {
+    if (!out || out->direct) {
+        stdout_write_file(group_sep, data, len);
+        return;
+    }
+    if (out->len == 0 && len > 0) out->group_sep = group_sep;
+    outbuf_write(out, data, len);
+}
+
+// Output of a search that may go into the cache.  Once it outgrows
+// CACHE_MAX_OUTPUT it is passed on to dest as it comes and is not cached.
+typedef struct {
+    OutBuf buf;
+    OutBuf *dest;
+    int overflow;
+} Capture;
+
+void capture_spill(OutBuf *ob) {
+    Capture *cap = ob->ctx;
+    cap->overflow = 1;
+    write_output(cap->dest, ob->group_sep, ob->data, ob->len);
+    ob->len = 0;
+    ob->group_sep = NULL;
+}
+
+// Search one file, or replay what searching it printed last time if it
+// has not changed since.  Its output goes to out, or to stdout if out is
+// NULL.
+int process_file(const char *filename, Options *opts, int num_files, int print_filename, OutBuf *out) {
+    ResultCache *c = opts->cache;
+    CacheRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    if (!c || !file_identity(filename, &rec.file)) return search_file(filename, opts, num_files, print_filename, out, NULL);
+    rec.options = c->options;
+
+    EnterCriticalSection(&c->lock);
+    CacheEntry *e = cache_find(c, c->options, filename);
+    int hit = e && same_file_identity(&e->rec.file, &rec.file);
+    char *output = NULL;
+    if (hit) {
+        e->used = 1;
+        rec = e->rec;
+        output = malloc(rec.output_len ? rec.output_len : 1);
+        memcpy(output, e->output, rec.output_len);
+    }
+    LeaveCriticalSection(&c->lock);
+
+    int found;
+    if (hit) {
+        found = rec.flags & CACHE_FOUND;
+        if (rec.flags & CACHE_BINARY) fprintf(stderr, "grep: %s: binary file matches\n", filename);
+        write_output(out, rec.flags & CACHE_GROUP ? opts->group_separator : NULL, output, rec.output_len);
+        free(output);
+        if (found && opts->quiet) stop_search();
+    } else {
+        Capture cap;
+        memset(&cap, 0, sizeof(cap));
+        cap.dest = out;
+        cap.buf.spill = capture_spill;
+        cap.buf.spill_at = CACHE_MAX_OUTPUT;
+        cap.buf.ctx = &cap;
+        int binary;
+        found = search_file(filename, opts, num_files, print_filename, &cap.buf, &binary);
+        write_output(out, cap.buf.group_sep, cap.buf.data, cap.buf.len);
+        // A search cut short by -q elsewhere did not finish the file.  A
+        // file written just before the run may change without a new
+        // identity, so its result is not kept.
+        int settled = rec.file.mtime + FILE_TIME_SLACK <= c->started;
+        if (!cap.overflow && (found || !search_is_stopped()) && settled) {
+            rec.flags = (found ? CACHE_FOUND : 0) | (binary ? CACHE_BINARY : 0) | (cap.buf.group_sep ? CACHE_GROUP : 0);
+            rec.path_len = (uint32_t)strlen(filename);
+            rec.output_len = (uint32_t)cap.buf.len;
+            EnterCriticalSection(&c->lock);
+            e = cache_find(c, c->options, filename);
+            if (e) {
+                free(e->output);
+                e->rec = rec;
+                e->output = cap.buf.data;
+                e->used = 1;
+            } else {
+                cache_add(c, &rec, _strdup(filename), cap.buf.data);
+                c->entries[c->count - 1].used = 1;
+            }
+            LeaveCriticalSection(&c->lock);
+            cap.buf.data = NULL;
+        }
+        free(cap.buf.data);
+    }
+    if (!out || out->direct) stdout_lines_done();
+    return found;
+}
+
+// Whether recursion enters the directory entry name.
+int directory_selected(Options *opts, const char *name) {
+    if (glob_set_match(opts->exclude_dir_globs, name) >= 0) return 0;
+    return opts->recursive;
+}
+
+// Whether the file entry name passes --include, --exclude and
+// --exclude-from.  As in GNU grep, the last of those options to match
+// decides; a name none of them matches is skipped only if the first one
+// was --include.
+int file_selected(Options *opts, const char *name) {
+    if (opts->num_glob_rules == 0) return 1;
+    int include = glob_set_match(opts->include_globs, name);
+    int exclude = glob_set_match(opts->exclude_globs, name);
+    if (include < 0 && exclude < 0) return !opts->first_glob_include;
+    return include > exclude;
+}
+
+// --gitignore.  The .gitignore and .ignore files of a directory are read
+// when the directory is entered and apply to everything below it, on top
+// of those of the directories above.  An ignored directory is never read.
+// A pattern without a slash matches entry names at any depth; one with a
+// slash is matched, segment by segment, against the path relative to the
+// directory holding the ignore file.
+
+typedef struct {
+    char **segments;
+    int num_segments;
+    int negate;
+    int dir_only;
+    int anchored;
+} IgnoreRule;
+
+// The ignore rules in effect in a directory.  Directories without ignore
+// files share the scope of their parent; the tasks of a parallel search
+// hold references to it.
+typedef struct Ignore {
+    struct Ignore *parent;
+    size_t dir_len;
+    IgnoreRule *rules;
+    int num_rules;
+    volatile LONG refs;
+} Ignore;
+
+Ignore *ignore_retain(Ignore *ig) {
+    if (ig) InterlockedIncrement(&ig->refs);
+    return ig;
+}
+
+void ignore_release(Ignore *ig) {
+    while (ig && InterlockedDecrement(&ig->refs) == 0) {
+        Ignore *parent = ig->parent;
+        for (int i = 0; i < ig->num_rules; i++) {
+            for (int j = 0; j < ig->rules[i].num_segments; j++) free(ig->rules[i].segments[j]);
+            free(ig->rules[i].segments);
+        }
+        free(ig->rules);
+        free(ig);
+        ig = parent;
+    }
+}
+
+void ignore_add_rule(Ignore *ig, char *line) {
+    size_t len = strlen(line);
+    while (len > 0 && (line[len-1] == ' ' || line[len-1] == '\t') && !(len > 1 && line[len-2] == '\\')) len--;
+    line[len] = '\0';
+    if (len == 0 || line[0] == '#') return;
+    IgnoreRule rule = { NULL, 0, 0, 0, 0 };
+    if (line[0] == '!') {
+        rule.negate = 1;
+        line++;
+        len--;
+    }
+    if (len > 0 && line[len-1] == '/') {
+        rule.dir_only = 1;
+        line[--len] = '\0';
+    }
+    rule.anchored = strchr(line, '/') != NULL;
+    if (line[0] == '/') line++;
+    if (!*line) return;
+    for (char *seg = line;;) {
+        char *slash = strchr(seg, '/');
+        if (slash) *slash = '\0';
+        rule.segments = realloc(rule.segments, (rule.num_segments + 1) * sizeof(char *));
+        rule.segments[rule.num_segments++] = _strdup(seg);
+        if (!slash) break;
+        seg = slash + 1;
+    }
+    ig->rules = realloc(ig->rules, (ig->num_rules + 1) * sizeof(IgnoreRule));
+    ig->rules[ig->num_rules++] = rule;
+}
+
+// The scope of dirname, whose parent directory has scope parent.  Returns
+// a new reference.
+Ignore *ignore_enter(Ignore *parent, const char *dirname) {
+    static const char *names[] = { ".gitignore", ".ignore" };
+    Ignore *ig = NULL;
+    char path[1024];
+    char *line = NULL;
+    size_t cap = 0;
+    for (int i = 0; i < 2; i++) {
+        snprintf(path, sizeof(path), "%s\\%s", dirname, names[i]);
+        FILE *fp = fopen(path, "r");
+        if (!fp) continue;
+        if (!ig) {
+            ig = calloc(1, sizeof(Ignore));
+            ig->parent = ignore_retain(parent);
+            ig->dir_len = strlen(dirname);
+            ig->refs = 1;
+        }
+        while (read_text_line(fp, &line, &cap)) ignore_add_rule(ig, line);
+        fclose(fp);
+    }
+    free(line);
+    return ig ? ig : ignore_retain(parent);
+}
+
+// Match glob segments against a path whose components are separated by
+// '/' or '\\'.  A '**' segment matches any number of components.
+int match_segments(char **segments, int n, const char *path) {
+    if (n == 0) return *path == '\0';
+    if (strcmp(segments[0], "**") == 0) {
+        if (n == 1) return 1;
+        for (const char *p = path;;) {
+            if (match_segments(segments + 1, n - 1, p)) return 1;
+            p = strpbrk(p, "/\\");
+            if (!p) return 0;
+            p++;
+        }
+    }
+    const char *sep = strpbrk(path, "/\\");
+    size_t len = sep ? (size_t)(sep - path) : strlen(path);
+    char name[MAX_PATH];
+    if (len >= sizeof(name)) return 0;
+    memcpy(name, path, len);
+    name[len] = '\0';
+    if (!match_glob(segments[0], name)) return 0;
+    return sep ? match_segments(segments + 1, n - 1, sep + 1) : n == 1;
+}
+
+// Whether the entry at path, named name, is ignored.  The deepest ignore
+// file decides, and within a file the last matching rule.
+int ignore_match(Ignore *ig, const char *path, const char *name, int is_dir) {
+    for (; ig; ig = ig->parent) {
+        for (int i = ig->num_rules - 1; i >= 0; i--) {
+            IgnoreRule *r = &ig->rules[i];
+            if (r->dir_only && !is_dir) continue;
+            int matched = r->anchored ? match_segments(r->segments, r->num_segments, path + ig->dir_len + 1)
+                                      : match_glob(r->segments[0], name);
+            if (matched) return !r->negate;
+        }
+    }
+    return 0;
+}
+
+// Trigram index (--index-build, --index).  The index of a directory tree
+// lists its files with their size, modification time and file ID and,
+// for every three-byte sequence, the files that contain it; letters are
+// folded to lower case so that one index serves -i too.  A query only reads the
+// files that contain every trigram of at least one of the literals any
+// selected line must hold.  A file whose size, time or ID changed since
+// the index was built, or that is not in it, is searched as usual, so
+// results are those of a full scan.  Files written less than
+// FILE_TIME_SLACK before the build started are left out.
+//
+// The index is the file INDEX_NAME in the tree's top directory:
+//   header     magic, number of files, number of trigrams, size of the
+//              path and postings areas
+//   files      IndexFile records
+//   trigrams   IndexTrigram records sorted by trigram
+//   paths      NUL-terminated paths relative to the top directory
+//   postings   per trigram, increasing file numbers as varint deltas
+
+#define INDEX_NAME ".grepindex"
+#define INDEX_MAGIC "GRPIDX2\n"
+
+typedef struct {
+    char magic[8];
+    uint32_t num_files;
+    uint32_t num_trigrams;
+    uint64_t paths_size;
+    uint64_t postings_size;
+} IndexHeader;
+
+typedef struct {
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t file_id;
+    uint64_t path;
+} IndexFile;
+
+typedef struct {
+    uint32_t trigram;
+    uint32_t count;
+    uint64_t postings;
+} IndexTrigram;
+
+typedef struct {
+    char *data;
+    size_t root_len;
+    IndexHeader *header;
+    IndexFile *files;
+    IndexTrigram *trigrams;
+    const char *paths;
+    const unsigned char *postings;
+    int *slots;
+    int slots_cap;
+    unsigned char *candidate;
+} SearchIndex;
+
+unsigned index_path_hash(const char *s) {
+    unsigned h = 2166136261u;
+    for (; *s; s++) {
+        // The same path may be spelled with either separator.
+        unsigned char c = *s == '/' ? '\\' : (unsigned char)*s;
+        h = (h ^ c) * 16777619u;
+    }
+    return h;
+}
+
+int index_path_equal(const char *a, const char *b) {
+    for (; *a && *b; a++, b++) {
+        if (*a != *b && !((*a == '/' || *a == '\\') && (*b == '/' || *b == '\\'))) return 0;
+    }
+    return *a == *b;
+}
+
+const unsigned char *read_varint(const unsigned char *p, const unsigned char *end, uint32_t *value) {
+    uint32_t v = 0;
+    for (int shift = 0; p < end && shift < 35; shift += 7) {
+        unsigned char b = *p++;
+        v |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            *value = v;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Decode the file numbers of a trigram.  Returns their count, or -1 if
+// the postings are corrupt.
+int index_postings(SearchIndex *ix, IndexTrigram *t, uint32_t *ids) {
+    const unsigned char *p = ix->postings + t->postings;
+    const unsigned char *end = ix->postings + ix->header->postings_size;
+    uint32_t id = 0;
+    for (uint32_t i = 0; i < t->count; i++) {
+        uint32_t delta;
+        p = read_varint(p, end, &delta);
+        if (!p) return -1;
+        id += delta;
+        if (id >= ix->header->num_files) return -1;
+        ids[i] = id;
+    }
+    return (int)t->count;
+}
+
+IndexTrigram *index_find_trigram(SearchIndex *ix, uint32_t trigram) {
+    int lo = 0, hi = (int)ix->header->num_trigrams;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ix->trigrams[mid].trigram < trigram) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < (int)ix->header->num_trigrams && ix->trigrams[lo].trigram == trigram ? &ix->trigrams[lo] : NULL;
+}
+
+uint32_t fold_trigram(const char *p) {
+    return (uint32_t)fold_table[(unsigned char)p[0]] << 16 | (uint32_t)fold_table[(unsigned char)p[1]] << 8 |
+           fold_table[(unsigned char)p[2]];
+}
+
+// The literals that every selected line holds one of, or NULL if the
+// index cannot narrow the search for these options.
+LiteralSet *index_literals(Options *opts) {
+    // The index holds the trigrams of files as stored, not decompressed.
+    if (opts->invert_match || opts->decompress) return NULL;
+    LiteralSet *set = opts->engine == ENGINE_FIXED ? opts->fixed_set : opts->literal_set;
+    if (!set || set->count == 0) return NULL;
+    for (int i = 0; i < set->count; i++) {
+        if (set->lens[i] < 3) return NULL;
+    }
+    return set;
+}
+
+// Mark the files that hold all trigrams of at least one literal.
+int index_mark_candidates(SearchIndex *ix, LiteralSet *set) {
+    uint32_t n = ix->header->num_files;
+    ix->candidate = calloc(n ? n : 1, 1);
+    uint32_t *ids = malloc((n ? n : 1) * sizeof(uint32_t));
+    uint32_t *next = malloc((n ? n : 1) * sizeof(uint32_t));
+    int ok = 1;
+    for (int i = 0; i < set->count && ok; i++) {
+        int count = -1;
+        for (size_t k = 0; k + 3 <= set->lens[i]; k++) {
+            IndexTrigram *t = index_find_trigram(ix, fold_trigram(set->pats[i] + k));
+            if (!t) {
+                count = 0;
+                break;
+            }
+            if (t->count > n) {
+                ok = 0;
+                break;
+            }
+            if (count < 0) {
+                count = index_postings(ix, t, ids);
+                if (count < 0) ok = 0;
+                continue;
+            }
+            int m = index_postings(ix, t, next);
+            if (m < 0) {
+                ok = 0;
+                break;
             }
+            // Both lists are increasing; keep the numbers in both.
+            int a = 0, b = 0, out = 0;
+            while (a < count && b < m) {
+                if (ids[a] < next[b]) a++;
+                else if (ids[a] > next[b]) b++;
+                else ids[out++] = ids[a++], b++;
+            }
+            count = out;
+            if (count == 0) break;
+        }
+        for (int k = 0; ok && k < count; k++) ix->candidate[ids[k]] = 1;
+    }
+    free(ids);
+    free(next);
+    return ok;
+}
+
+// Load the index of the tree at dirname for a search with opts.  Returns
+// NULL if there is none or it cannot help.
+SearchIndex *index_load(const char *dirname, Options *opts) {
+    LiteralSet *set = index_literals(opts);
+    if (!set) return NULL;
+    char path[1024];
+    snprintf(path, sizeof(path), "%s\\%s", dirname, INDEX_NAME);
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+    SearchIndex *ix = calloc(1, sizeof(SearchIndex));
+    size_t size = 0, cap = 1 << 16;
+    ix->data = malloc(cap);
+    size_t n;
+    while ((n = fread(ix->data + size, 1, cap - size, fp)) > 0) {
+        size += n;
+        if (size == cap) {
+            cap *= 2;
+            ix->data = realloc(ix->data, cap);
+        }
+    }
+    fclose(fp);
+
+    IndexHeader *h = (IndexHeader *)ix->data;
+    size_t files_at = sizeof(IndexHeader);
+    size_t trigrams_at = files_at + (size >= files_at ? (size_t)h->num_files * sizeof(IndexFile) : 0);
+    size_t paths_at = trigrams_at + (size >= files_at ? (size_t)h->num_trigrams * sizeof(IndexTrigram) : 0);
+    int valid = size >= files_at && memcmp(h->magic, INDEX_MAGIC, 8) == 0 && paths_at <= size &&
+                h->paths_size <= size - paths_at && h->postings_size == size - paths_at - h->paths_size &&
+                (h->paths_size == 0 || ix->data[paths_at + h->paths_size - 1] == '\0');
+    if (valid) {
+        ix->header = h;
+        ix->files = (IndexFile *)(ix->data + files_at);
+        ix->trigrams = (IndexTrigram *)(ix->data + trigrams_at);
+        ix->paths = ix->data + paths_at;
+        ix->postings = (const unsigned char *)ix->paths + h->paths_size;
+        for (uint32_t i = 0; i < h->num_files && valid; i++) valid = ix->files[i].path < h->paths_size;
+        for (uint32_t i = 0; i < h->num_trigrams && valid; i++) valid = ix->trigrams[i].postings <= h->postings_size;
+    }
+    if (!valid || !index_mark_candidates(ix, set)) {
+        if (!opts->no_messages) fprintf(stderr, "grep: %s: invalid index, ignored\n", path);
+        free(ix->candidate);
+        free(ix->data);
+        free(ix);
+        return NULL;
+    }
+
+    ix->root_len = strlen(dirname);
+    ix->slots_cap = 16;
+    while (ix->slots_cap < (int)h->num_files * 2) ix->slots_cap *= 2;
+    ix->slots = malloc(ix->slots_cap * sizeof(int));
+    memset(ix->slots, -1, ix->slots_cap * sizeof(int));
+    for (uint32_t i = 0; i < h->num_files; i++) {
+        unsigned j = index_path_hash(ix->paths + ix->files[i].path) & (ix->slots_cap - 1);
+        while (ix->slots[j] >= 0) j = (j + 1) & (ix->slots_cap - 1);
+        ix->slots[j] = (int)i;
+    }
+    return ix;
+}
+
+// Whether the file at path, below the indexed tree, is up to date in the
+// index and cannot have a selected line.
+int index_rules_out(SearchIndex *ix, const char *path) {
+    const char *rel = path + ix->root_len + 1;
+    for (unsigned j = index_path_hash(rel) & (ix->slots_cap - 1); ix->slots[j] >= 0; j = (j + 1) & (ix->slots_cap - 1)) {
+        IndexFile *f = &ix->files[ix->slots[j]];
+        if (index_path_equal(ix->paths + f->path, rel)) {
+            FileIdentity id;
+            if (ix->candidate[ix->slots[j]] || !file_identity(path, &id)) return 0;
+            return f->size == id.size && f->mtime == id.mtime && f->file_id == id.file_id;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    char *path;
+    int is_dir;
+    int no_match;
+} DirEntry;
+
+int compare_entries(const void *a, const void *b) {
+    return strcmp(((const DirEntry *)a)->path, ((const DirEntry *)b)->path);
+}
+
+// The entries of dirname that the search visits: the subdirectories that
+// recursion enters and the files that pass the name filters and are not
+// ignored in the scope ignore.  Files that index rules out are marked
+// no_match.  The entries are in name order under --sort=path and in
+// directory order otherwise.  Returns NULL with *count 0 if the directory
+// cannot be read.
+DirEntry *read_directory(const char *dirname, Options *opts, Ignore *ignore, SearchIndex *index, int *count) {
+    char path[1024];
+    sprintf(path, "%s\\*", dirname);
+    *count = 0;
+
+    struct _finddata_t finddata;
+    intptr_t handle = _findfirst(path, &finddata);
+    if (handle == -1) {
+        if (errno != 0) perror(dirname);
+        return NULL;
+    }
+
+    DirEntry *entries = NULL;
+    int cap = 0;
+    do {
+        if (strcmp(finddata.name, ".") == 0 || strcmp(finddata.name, "..") == 0) continue;
+        int is_dir = (finddata.attrib & _A_SUBDIR) != 0;
+        if (!is_dir && strcmp(finddata.name, INDEX_NAME) == 0) continue;
+        if (is_dir ? !directory_selected(opts, finddata.name) : !file_selected(opts, finddata.name)) continue;
+        if (opts->gitignore && is_dir && strcmp(finddata.name, ".git") == 0) continue;
+        snprintf(path, sizeof(path), "%s\\%s", dirname, finddata.name);
+        if (ignore && ignore_match(ignore, path, finddata.name, is_dir)) continue;
+        if (*count == cap) {
+            cap = cap ? cap * 2 : 16;
+            entries = realloc(entries, cap * sizeof(DirEntry));
+        }
+        entries[*count].path = _strdup(path);
+        entries[*count].is_dir = is_dir;
+        entries[*count].no_match = !is_dir && index && index_rules_out(index, path);
+        (*count)++;
+    } while (_findnext(handle, &finddata) == 0);
+    _findclose(handle);
+
+    if (opts->sort_path && *count > 1) qsort(entries, *count, sizeof(DirEntry), compare_entries);
+    return entries;
+}
+
+// A file known to have no selected line: only -c and -L print anything.
+int finish_without_match(const char *filename, Options *opts, int print_filename, OutBuf *out) {
+    SearchState st;
+    search_init(&st, opts, filename, print_filename, out);
+    search_finish(&st);
+    search_free(&st);
+    return st.found;
+}
+
+// parent is the ignore scope of the directory above, if any; index is the
+// trigram index of the tree, if one is used.
+int process_directory(const char *dirname, Options *opts, int num_files, int print_filename, Ignore *parent, SearchIndex *index) {
+    int found = 0;
+    int count;
+    Ignore *ignore = opts->gitignore ? ignore_enter(parent, dirname) : NULL;
+    DirEntry *entries = read_directory(dirname, opts, ignore, index, &count);
+    for (int i = 0; i < count; i++) {
+        if (search_is_stopped()) {
+            free(entries[i].path);
+            continue;
+        }
+        if (entries[i].is_dir) {
+            found |= process_directory(entries[i].path, opts, num_files, print_filename, ignore, index);
+        } else if (entries[i].no_match) {
+            found |= finish_without_match(entries[i].path, opts, print_filename, NULL);
         } else {
-            break;
+            found |= process_file(entries[i].path, opts, num_files, print_filename, NULL);
         }
-        i++;
+        free(entries[i].path);
     }
+    free(entries);
+    ignore_release(ignore);
+    return found;
+}
 
-    if (opts->num_patterns == 0 && opts->pattern_file == NULL) {
-        if (i >= argc) {
-            print_usage();
-            return 1;
+// Building the index.  Each file's distinct trigrams are collected with
+// the seen bitmap, then its number is appended to their postings, which
+// are kept varint-encoded in a hash table on trigrams.
+
+typedef struct {
+    uint32_t trigram;
+    uint32_t count;
+    uint32_t last;
+    size_t len;
+    size_t cap;
+    unsigned char *data;
+} IndexPostings;
+
+typedef struct {
+    const char *root;
+    size_t root_len;
+    uint64_t started;
+    IndexFile *files;
+    uint32_t num_files;
+    uint32_t files_cap;
+    char *paths;
+    size_t paths_len;
+    size_t paths_cap;
+    IndexPostings *lists;
+    int num_lists;
+    int *slots;
+    int slots_cap;
+    unsigned char *seen;
+    uint32_t *touched;
+    size_t num_touched;
+    size_t touched_cap;
+} IndexBuilder;
+
+IndexPostings *builder_postings(IndexBuilder *b, uint32_t trigram) {
+    if ((b->num_lists + 1) * 2 > b->slots_cap) {
+        b->slots_cap = b->slots_cap ? b->slots_cap * 2 : 4096;
+        b->slots = realloc(b->slots, b->slots_cap * sizeof(int));
+        memset(b->slots, -1, b->slots_cap * sizeof(int));
+        b->lists = realloc(b->lists, (b->slots_cap / 2) * sizeof(IndexPostings));
+        for (int i = 0; i < b->num_lists; i++) {
+            unsigned j = (b->lists[i].trigram * 2654435761u) & (b->slots_cap - 1);
+            while (b->slots[j] >= 0) j = (j + 1) & (b->slots_cap - 1);
+            b->slots[j] = i;
         }
-        opts->patterns[opts->num_patterns++] = argv[i];
-        i++;
     }
+    unsigned j = (trigram * 2654435761u) & (b->slots_cap - 1);
+    while (b->slots[j] >= 0) {
+        if (b->lists[b->slots[j]].trigram == trigram) return &b->lists[b->slots[j]];
+        j = (j + 1) & (b->slots_cap - 1);
+    }
+    b->slots[j] = b->num_lists;
+    IndexPostings *p = &b->lists[b->num_lists++];
+    memset(p, 0, sizeof(*p));
+    p->trigram = trigram;
+    return p;
+}
+
+void builder_add_text(IndexBuilder *b, const char *data, size_t size) {
+    for (size_t i = 0; i + 3 <= size; i++) {
+        uint32_t t = fold_trigram(data + i);
+        if (b->seen[t >> 3] & (1 << (t & 7))) continue;
+        b->seen[t >> 3] |= 1 << (t & 7);
+        if (b->num_touched == b->touched_cap) {
+            b->touched_cap = b->touched_cap ? b->touched_cap * 2 : 4096;
+            b->touched = realloc(b->touched, b->touched_cap * sizeof(uint32_t));
+        }
+        b->touched[b->num_touched++] = t;
+    }
+}
 
-    // Load patterns from file if specified
-    if (opts->pattern_file) {
-        FILE *fp = fopen(opts->pattern_file, "r");
+void builder_add_file(IndexBuilder *b, DirEntry *e) {
+    // The identity is taken before the contents are read, so a write in
+    // between leaves the entry stale rather than wrong.
+    FileIdentity identity;
+    if (!file_identity(e->path, &identity) || identity.mtime + FILE_TIME_SLACK > b->started) return;
+    MappedFile mf;
+    char *buffer = NULL;
+    const char *data;
+    size_t size = 0;
+    if (map_file(e->path, &mf)) {
+        data = mf.data;
+        size = mf.size;
+    } else {
+        FILE *fp = fopen(e->path, "rb");
         if (!fp) {
-            perror("fopen");
-            return 1;
+            perror(e->path);
+            return;
         }
-        char line[MAX_LINE];
-        while (fgets(line, sizeof(line), fp)) {
-            size_t len = strlen(line);
-            while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) {
-                line[--len] = '\0';
-            }
-            if (opts->num_patterns < MAX_PATTERNS) {
-                opts->patterns[opts->num_patterns++] = strdup(line);
+        size_t cap = 1 << 16, n;
+        buffer = malloc(cap);
+        while ((n = fread(buffer + size, 1, cap - size, fp)) > 0) {
+            size += n;
+            if (size == cap) {
+                cap *= 2;
+                buffer = realloc(buffer, cap);
             }
         }
         fclose(fp);
+        data = buffer;
     }
+    uint32_t id = b->num_files;
+    builder_add_text(b, data, size);
+    if (buffer) free(buffer);
+    else unmap_file(&mf);
 
-    if (opts->pattern_type == 1 || opts->pattern_type == 3) {
-        uint32_t options = PCRE2_UTF;
-        if (opts->pattern_type == 1) options |= PCRE2_EXTENDED;
-        if (opts->ignore_case) options |= PCRE2_CASELESS;
-        char *pat = opts->patterns[0];
-        char *mod_pat = NULL;
-        if (opts->word_regexp) {
-            mod_pat = malloc(strlen(pat) + 5);
-            sprintf(mod_pat, "\\b%s\\b", pat);
-            pat = mod_pat;
-        }
-        if (opts->line_regexp) {
-            char *temp = malloc(strlen(pat) + 3);
-            sprintf(temp, "^%s$", pat);
-            if (mod_pat) free(mod_pat);
-            pat = temp;
-            mod_pat = temp;
-        }
-        PCRE2_SIZE erroroffset;
-        int errorcode;
-        opts->code = pcre2_compile((PCRE2_SPTR)pat, PCRE2_ZERO_TERMINATED, options, &errorcode, &erroroffset, NULL);
-        if (!opts->code) {
-            PCRE2_UCHAR buffer[256];
-            pcre2_get_error_message(errorcode, buffer, sizeof(buffer));
-            fprintf(stderr, "pcre2_compile failed: %s\n", buffer);
-            return 1;
+    for (size_t i = 0; i < b->num_touched; i++) {
+        uint32_t t = b->touched[i];
+        b->seen[t >> 3] &= ~(1 << (t & 7));
+        IndexPostings *p = builder_postings(b, t);
+        if (p->len + 5 > p->cap) {
+            p->cap = p->cap ? p->cap * 2 : 8;
+            p->data = realloc(p->data, p->cap);
         }
-        if (mod_pat) free(mod_pat);
+        uint32_t delta = id - p->last;
+        do {
+            unsigned char byte = delta & 0x7F;
+            delta >>= 7;
+            p->data[p->len++] = byte | (delta ? 0x80 : 0);
+        } while (delta);
+        p->last = id;
+        p->count++;
     }
+    b->num_touched = 0;
 
-    *argi = i;
-    return 0;
+    const char *rel = e->path + b->root_len + 1;
+    size_t rel_len = strlen(rel) + 1;
+    if (b->paths_len + rel_len > b->paths_cap) {
+        b->paths_cap = (b->paths_len + rel_len) * 2;
+        b->paths = realloc(b->paths, b->paths_cap);
+    }
+    if (b->num_files == b->files_cap) {
+        b->files_cap = b->files_cap ? b->files_cap * 2 : 1024;
+        b->files = realloc(b->files, b->files_cap * sizeof(IndexFile));
+    }
+    IndexFile *f = &b->files[b->num_files++];
+    f->size = identity.size;
+    f->mtime = identity.mtime;
+    f->file_id = identity.file_id;
+    f->path = b->paths_len;
+    memcpy(b->paths + b->paths_len, rel, rel_len);
+    b->paths_len += rel_len;
 }
 
-int match_line(Options *opts, const char *line) {
-    if (opts->pattern_type == 1 || opts->pattern_type == 3) {
-        pcre2_match_data *match_data = pcre2_match_data_create_from_pattern(opts->code, NULL);
-        int rc = pcre2_match(opts->code, (PCRE2_SPTR)line, strlen(line), 0, 0, match_data, NULL);
-        pcre2_match_data_free(match_data);
-        return rc > 0;
-    } else {
-        for (int i = 0; i < opts->num_patterns; i++) {
-            const char *pat = opts->patterns[i];
-            if (opts->line_regexp) {
-                int cmp = opts->ignore_case ? _stricmp(line, pat) : strcmp(line, pat);
-                if (cmp == 0) {
-                    return 1;
-                }
-            } else if (opts->word_regexp) {
-                if (opts->ignore_case) {
-                    char *line_lower = _strdup(line);
-                    char *pat_lower = _strdup(pat);
-                    for (char *p = line_lower; *p; p++) *p = tolower(*p);
-                    for (char *p = pat_lower; *p; p++) *p = tolower(*p);
-                    const char *pos = strstr(line_lower, pat_lower);
-                    if (pos) {
-                        size_t pat_len = strlen(pat);
-                        size_t line_len = strlen(line);
-                        size_t offset = pos - line_lower;
-                        int start_ok = (offset == 0) || (!isalnum((unsigned char)line[offset-1]) && line[offset-1] != '_');
-                        int end_ok = (offset + pat_len == line_len) || (!isalnum((unsigned char)line[offset + pat_len]) && line[offset + pat_len] != '_');
-                        free(line_lower);
-                        free(pat_lower);
-                        if (start_ok && end_ok) {
-                            return 1;
-                        }
-                    }
-                    free(line_lower);
-                    free(pat_lower);
-                } else {
-                    const char *pos = strstr(line, pat);
-                    if (pos) {
-                        size_t pat_len = strlen(pat);
-                        size_t line_len = strlen(line);
-                        int start_ok = (pos == line) || (!isalnum((unsigned char)pos[-1]) && pos[-1] != '_');
-                        int end_ok = ((pos - line) + pat_len == line_len) || (!isalnum((unsigned char)pos[pat_len]) && pos[pat_len] != '_');
-                        if (start_ok && end_ok) {
-                            return 1;
-                        }
-                    }
-                }
-            } else {
-                if (opts->ignore_case ? contains_ignore_case(line, pat) : (strstr(line, pat) != NULL)) {
-                    return 1;
-                }
-            }
+// Index the files the recursive search would visit.
+void builder_walk(IndexBuilder *b, const char *dirname, Options *opts, Ignore *parent) {
+    int count;
+    Ignore *ignore = opts->gitignore ? ignore_enter(parent, dirname) : NULL;
+    DirEntry *entries = read_directory(dirname, opts, ignore, NULL, &count);
+    for (int i = 0; i < count; i++) {
+        if (entries[i].is_dir) {
+            builder_walk(b, entries[i].path, opts, ignore);
+        } else {
+            builder_add_file(b, &entries[i]);
         }
-        return 0;
+        free(entries[i].path);
     }
+    free(entries);
+    ignore_release(ignore);
 }
 
-int process_file(const char *filename, Options *opts, int num_files, int print_filename) {
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        if (!opts->no_messages && errno != 0) perror(filename);
-        return 0;
-    }
+int compare_postings(const void *a, const void *b) {
+    uint32_t x = ((const IndexPostings *)a)->trigram, y = ((const IndexPostings *)b)->trigram;
+    return x < y ? -1 : x > y;
+}
 
-    // Collect all lines
-    Line *lines = NULL;
-    int num_lines = 0;
-    int capacity = 0;
-    size_t current_offset = 0;
-
-    if (opts->null_data) {
-        // Read whole file and split by \0
-        fseek(fp, 0, SEEK_END);
-        long file_size = ftell(fp);
-        fseek(fp, 0, SEEK_SET);
-        char *buffer = malloc(file_size + 1);
-        if (!buffer) {
-            perror("malloc");
-            fclose(fp);
-            return 0;
-        }
-        size_t read_size = fread(buffer, 1, file_size, fp);
-        buffer[read_size] = '\0';
+// --index-build: write the index of the tree at dirname.  Returns 0 on
+// success.
+int index_build(const char *dirname, Options *opts) {
+    IndexBuilder b;
+    memset(&b, 0, sizeof(b));
+    b.root = dirname;
+    b.root_len = strlen(dirname);
+    b.seen = calloc(1 << 21, 1);
+    b.started = current_file_time();
+    opts->recursive = 1;
+    builder_walk(&b, dirname, opts, NULL);
 
-        char *start = buffer;
-        char *end;
-        while ((end = strchr(start, '\0')) != NULL) {
-            size_t len = end - start;
-            if (num_lines >= capacity) {
-                capacity = capacity ? capacity * 2 : 1024;
-                lines = realloc(lines, capacity * sizeof(Line));
-            }
-            lines[num_lines].text = malloc(len + 1);
-            memcpy(lines[num_lines].text, start, len);
-            lines[num_lines].text[len] = '\0';
-            lines[num_lines].len = len;
-            lines[num_lines].is_match = 0;
-            lines[num_lines].match_start = -1;
-            lines[num_lines].match_end = -1;
-            lines[num_lines].byte_offset = current_offset;
-            current_offset += len + 1; // +1 for \0
-            num_lines++;
-            start = end + 1;
-            if (start >= buffer + read_size) break;
-        }
-        free(buffer);
-    } else {
-        char line_buf[MAX_LINE];
-        while (fgets(line_buf, sizeof(line_buf), fp)) {
-            if (num_lines >= capacity) {
-                capacity = capacity ? capacity * 2 : 1024;
-                lines = realloc(lines, capacity * sizeof(Line));
-            }
-            size_t len = strlen(line_buf);
-            while (len > 0 && (line_buf[len-1] == '\n' || line_buf[len-1] == '\r')) {
-                line_buf[--len] = '\0';
-            }
-            lines[num_lines].text = strdup(line_buf);
-            lines[num_lines].len = len;
-            lines[num_lines].is_match = 0;
-            lines[num_lines].match_start = -1;
-            lines[num_lines].match_end = -1;
-            lines[num_lines].byte_offset = current_offset;
-            current_offset += len;
-            num_lines++;
+    qsort(b.lists, b.num_lists, sizeof(IndexPostings), compare_postings);
+    IndexHeader h;
+    memcpy(h.magic, INDEX_MAGIC, 8);
+    h.num_files = b.num_files;
+    h.num_trigrams = b.num_lists;
+    h.paths_size = b.paths_len;
+    h.postings_size = 0;
+    for (int i = 0; i < b.num_lists; i++) h.postings_size += b.lists[i].len;
+
+    // Write to a temporary name, so a search never sees half an index.
+    char path[1024], tmp[1040];
+    snprintf(path, sizeof(path), "%s\\%s", dirname, INDEX_NAME);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "wb");
+    int ok = fp != NULL;
+    if (ok) {
+        ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+        if (b.num_files) ok = ok && fwrite(b.files, sizeof(IndexFile), b.num_files, fp) == b.num_files;
+        uint64_t at = 0;
+        for (int i = 0; i < b.num_lists && ok; i++) {
+            IndexTrigram t = { b.lists[i].trigram, b.lists[i].count, at };
+            ok = fwrite(&t, sizeof(t), 1, fp) == 1;
+            at += b.lists[i].len;
         }
+        if (b.paths_len) ok = ok && fwrite(b.paths, 1, b.paths_len, fp) == b.paths_len;
+        for (int i = 0; i < b.num_lists && ok; i++) ok = fwrite(b.lists[i].data, 1, b.lists[i].len, fp) == b.lists[i].len;
+        ok = fclose(fp) == 0 && ok;
+    }
+    if (ok) ok = replace_file(tmp, path) == 0;
+    if (!ok) {
+        fprintf(stderr, "grep: %s: %s\n", path, strerror(errno));
+        remove(tmp);
     }
-    fclose(fp);
 
-    // Check if binary
-    int is_binary = 0;
-    int found = 0;
-    /*
-    if (opts->binary_files_type == 0) {
-        for (int i = 0; i < num_lines; i++) {
-            for (size_t j = 0; j < lines[i].len; j++) {
-                if (lines[i].text[j] == 0) {
-                    is_binary = 1;
-                    break;
-                }
-            }
-            if (is_binary) break;
+    for (int i = 0; i < b.num_lists; i++) free(b.lists[i].data);
+    free(b.lists);
+    free(b.slots);
+    free(b.seen);
+    free(b.touched);
+    free(b.files);
+    free(b.paths);
+    return !ok;
+}
+
+// Parallel search (-j).  Reading a directory and searching a file are
+// tasks, kept on one deque per worker.  A worker takes the newest task
+// from its own deque, so it walks its part of the tree depth-first and
+// its deque stays short; an idle worker steals the oldest task from
+// another, which in a directory tree is usually the largest piece of work
+// left.  A large mapped file is split into chunks that are tasks of their
+// own, so even a single file keeps every worker busy.
+//
+// Each file's output is collected in an OutBuf and written in one piece
+// when the file is done.  By default files come out in the order they
+// finish.  Under --sort=path the operands and the directories they hold
+// form a tree of OutNodes in the order of the sequential walk, and a
+// cursor writes out each finished file once everything before it has been
+// written; workers never wait for it, they just leave their output on the
+// node.
+
+#define TASK_FILE 0
+#define TASK_DIR 1
+#define TASK_CHUNK 2
+// A file the trigram index rules out.
+#define TASK_NO_MATCH 3
+
+// Files at least this large are searched in chunks of CHUNK_SIZE bytes,
+// ending on line terminators.
+#define CHUNK_SIZE (8 * 1024 * 1024)
+#define CHUNK_MIN_FILE (2 * CHUNK_SIZE)
+
+typedef struct OutNode {
+    struct OutNode *parent;
+    struct OutNode **children;
+    int num_children;
+    int next;
+    int ready;
+    OutBuf out;
+} OutNode;
+
+typedef struct WorkPool WorkPool;
+
+typedef struct {
+    const char *start;
+    size_t len;
+    long long lines;
+    OutBuf out;
+    long long match_count;
+    int done;
+} Chunk;
+
+// A file being searched by the pool.  A chunked file is counted first
+// when -n needs line numbers: every chunk counts its lines, and once all
+// have, the counts are summed into each chunk's first line number and the
+// chunks are searched.  Chunk output is appended to out in file order as
+// the chunks finish.
+typedef struct {
+    WorkPool *pool;
+    OutNode *node;
+    const char *path;
+    OutBuf out;
+    int streaming;
+    MappedFile mf;
+    Chunk *chunks;
+    int num_chunks;
+    int counting;
+    volatile LONG remaining;
+    volatile LONG decided;
+    CRITICAL_SECTION lock;
+    int next_merge;
+} FileJob;
+
+typedef struct {
+    int type;
+    char *path;
+    OutNode *node;
+    FileJob *job;
+    int chunk;
+    Ignore *ignore;
+    SearchIndex *index;
+} Task;
+
+typedef struct {
+    CRITICAL_SECTION lock;
+    Task *tasks;
+    int head;
+    int tail;
+    int cap;
+} TaskDeque;
+
+typedef struct {
+    WorkPool *pool;
+    TaskDeque deque;
+    Options opts;
+    HANDLE thread;
+    unsigned seed;
+    int found;
+} Worker;
+
+struct WorkPool {
+    Worker *workers;
+    int num_workers;
+    int num_files;
+    int print_filename;
+    int next_worker;
+    volatile LONG pending;
+    volatile LONG pushes;
+    int sleeping;
+    CRITICAL_SECTION idle_lock;
+    CONDITION_VARIABLE idle_cond;
+    CRITICAL_SECTION order_lock;
+    CONDITION_VARIABLE stream_cond;
+    FileJob *stream_owner;
+    OutNode *root;
+    OutNode *cursor;
+};
+
+void deque_push(TaskDeque *dq, Task task) {
+    EnterCriticalSection(&dq->lock);
+    if (dq->tail == dq->cap) {
+        if (dq->head > 0) {
+            memmove(dq->tasks, dq->tasks + dq->head, (dq->tail - dq->head) * sizeof(Task));
+            dq->tail -= dq->head;
+            dq->head = 0;
+        } else {
+            dq->cap = dq->cap ? dq->cap * 2 : 64;
+            dq->tasks = realloc(dq->tasks, dq->cap * sizeof(Task));
         }
     }
-    */
+    dq->tasks[dq->tail++] = task;
+    LeaveCriticalSection(&dq->lock);
+}
 
-    if (is_binary && opts->binary_files_type == 0) {
-        if (!opts->quiet) fprintf(stderr, "Binary file %s matches\n", filename);
-        for (int i = 0; i < num_lines; i++) free(lines[i].text);
-        free(lines);
-        return found;
+// Take the newest task (owner) or the oldest one (thief).
+int deque_take(TaskDeque *dq, int steal, Task *task) {
+    int ok = 0;
+    EnterCriticalSection(&dq->lock);
+    if (dq->head < dq->tail) {
+        *task = steal ? dq->tasks[dq->head++] : dq->tasks[--dq->tail];
+        if (dq->head == dq->tail) dq->head = dq->tail = 0;
+        ok = 1;
     }
+    LeaveCriticalSection(&dq->lock);
+    return ok;
+}
 
-    // Find matches
-    int match_count = 0;
-    for (int i = 0; i < num_lines; i++) {
-        int matches = match_line(opts, lines[i].text);
-        if (opts->invert_match) {
-            lines[i].is_match = !matches;
-        } else {
-            lines[i].is_match = matches;
+// The task takes over task.path.
+void pool_submit(Worker *w, Task task) {
+    WorkPool *pool = w->pool;
+    InterlockedIncrement(&pool->pending);
+    deque_push(&w->deque, task);
+    EnterCriticalSection(&pool->idle_lock);
+    InterlockedIncrement(&pool->pushes);
+    if (pool->sleeping > 0) WakeConditionVariable(&pool->idle_cond);
+    LeaveCriticalSection(&pool->idle_lock);
+}
+
+OutNode *out_node_new(OutNode *parent) {
+    OutNode *node = calloc(1, sizeof(OutNode));
+    node->parent = parent;
+    return node;
+}
+
+// Write out every finished node the cursor can reach, in order, freeing
+// them on the way.  Called with order_lock held.
+void pool_emit(WorkPool *pool) {
+    OutNode *node = pool->cursor;
+    int wrote = 0;
+    while (node && node->ready) {
+        if (node->next < node->num_children) {
+            node = node->children[node->next];
+            continue;
         }
-        if (lines[i].is_match) {
-            match_count++;
+        if (node->out.len > 0) {
+            stdout_write_file(node->out.group_sep, node->out.data, node->out.len);
+            wrote = 1;
         }
+        OutNode *parent = node->parent;
+        free(node->out.data);
+        free(node->children);
+        free(node);
+        if (parent) parent->next++;
+        node = parent;
     }
+    pool->cursor = node;
+    if (wrote) stdout_lines_done();
+}
 
-    // Output
-    if (opts->only_matching && (opts->before_context > 0 || opts->after_context > 0)) {
-        fprintf(stderr, "grep: the -o option cannot be used with -A, -B, or -C\n");
-        opts->before_context = opts->after_context = 0;
+// Without --sort, a file writes to stdout only while it holds the stream,
+// which a file with a lot of output keeps from its first write to its
+// last.  This is not a thread lock: the chunks of a file can finish on
+// any worker.
+void stream_acquire(WorkPool *pool, FileJob *job) {
+    EnterCriticalSection(&pool->order_lock);
+    while (pool->stream_owner) SleepConditionVariableCS(&pool->stream_cond, &pool->order_lock, INFINITE);
+    pool->stream_owner = job;
+    LeaveCriticalSection(&pool->order_lock);
+}
+
+void stream_release(WorkPool *pool) {
+    EnterCriticalSection(&pool->order_lock);
+    pool->stream_owner = NULL;
+    WakeAllConditionVariable(&pool->stream_cond);
+    LeaveCriticalSection(&pool->order_lock);
+}
+
+// OutBuf spill hook.  A file with a lot of output writes it to stdout as
+// it goes once it may: under --sort=path when everything before it has
+// been written, otherwise once it holds the stream.
+void pool_spill(OutBuf *ob) {
+    FileJob *job = ob->ctx;
+    WorkPool *pool = job->pool;
+    if (!job->node) {
+        stream_acquire(pool, job);
+        job->streaming = 1;
+        stdout_write_file(ob->group_sep, ob->data, ob->len);
+        ob->len = 0;
+        ob->direct = 1;
+        return;
+    }
+    EnterCriticalSection(&pool->order_lock);
+    if (pool->cursor == job->node) {
+        stdout_write_file(ob->group_sep, ob->data, ob->len);
+        ob->len = 0;
+        ob->direct = 1;
+    } else {
+        ob->spill_at = ob->len * 2;
     }
+    LeaveCriticalSection(&pool->order_lock);
+}
 
-    if (opts->list_files) {
-        if ((opts->invert_match && match_count == 0) || (!opts->invert_match && match_count > 0)) {
-            if (!opts->quiet) {
-                printf("%s", filename);
-                if (opts->null_output) printf("\0");
-                printf("\n");
-                found = 1;
-            }
-        }
-    } else if (opts->files_without_match) {
-        if (match_count == 0) {
-            if (!opts->quiet) {
-                printf("%s", filename);
-                if (opts->null_output) printf("\0");
-                printf("\n");
-                found = 1;
-            }
+void file_job_init(FileJob *job, WorkPool *pool, Task *task) {
+    memset(job, 0, sizeof(*job));
+    job->pool = pool;
+    job->node = task->node;
+    job->path = task->path;
+    job->out.spill = pool_spill;
+    job->out.ctx = job;
+    job->out.spill_at = OUTPUT_SPILL_SIZE;
+}
+
+// Hand the output of a finished file on to stdout.
+void file_job_done(FileJob *job) {
+    WorkPool *pool = job->pool;
+    if (job->node) {
+        EnterCriticalSection(&pool->order_lock);
+        job->node->out = job->out;
+        job->node->ready = 1;
+        pool_emit(pool);
+        LeaveCriticalSection(&pool->order_lock);
+        return;
+    }
+    if (!job->streaming && job->out.len > 0) {
+        stream_acquire(pool, job);
+        job->streaming = 1;
+        stdout_write_file(job->out.group_sep, job->out.data, job->out.len);
+    }
+    if (job->streaming) {
+        stdout_lines_done();
+        stream_release(pool);
+    }
+    free(job->out.data);
+}
+
+// Whether a file can be searched in chunks: every line must be judged
+// on its own, without context lines or a limit on the matches.
+int chunks_allowed(Options *opts) {
+    return opts->before_context == 0 && opts->after_context == 0 && opts->max_count == -1;
+}
+
+// Split a mapped file into chunks and queue them, last first so that
+// this worker starts at the beginning of the file.
+void file_job_split(Worker *w, FileJob *job) {
+    char eol = w->opts.null_data ? '\0' : '\n';
+    const char *p = job->mf.data;
+    const char *end = p + job->mf.size;
+    int cap = (int)(job->mf.size / CHUNK_SIZE) + 1;
+    job->chunks = calloc(cap, sizeof(Chunk));
+    while (p < end) {
+        const char *stop = end;
+        if ((size_t)(end - p) > CHUNK_SIZE) {
+            const char *nl = memchr(p + CHUNK_SIZE, eol, end - (p + CHUNK_SIZE));
+            if (nl) stop = nl + 1;
         }
-    } else if (opts->count) {
-        if (!opts->quiet) {
-            if (print_filename) {
-                printf("%s:", filename);
-            }
-            printf("%d\n", match_count);
-            found = 1;
+        if (job->num_chunks == cap) {
+            cap *= 2;
+            job->chunks = realloc(job->chunks, cap * sizeof(Chunk));
         }
-    } else if (opts->only_matching) {
-        if (!opts->quiet) {
-            for (int i = 0; i < num_lines; i++) {
-                if (lines[i].is_match) {
-                    if (opts->pattern_type == 2) { // fixed
-                        const char *pat = opts->patterns[0];
-                        const char *pos = lines[i].text;
-                        while ((pos = strstr(pos, pat)) != NULL) {
-                            if (print_filename) {
-                                printf("%s:", filename);
-                            }
-                            if (opts->line_number) {
-                                printf("%d:", i + 1);
-                            }
-                            if (opts->byte_offset) {
-                                printf("%zu:", lines[i].byte_offset + (pos - lines[i].text));
-                            }
-                            printf("%s\n", pat);
-                            pos += strlen(pat);
-                        }
-                    } else if (opts->pattern_type == 1 || opts->pattern_type == 3) { // extended or perl
-                        pcre2_match_data *match_data = pcre2_match_data_create_from_pattern(opts->code, NULL);
-                        size_t offset = 0;
-                        while (1) {
-                            int rc = pcre2_match(opts->code, (PCRE2_SPTR)lines[i].text, lines[i].len, offset, 0, match_data, NULL);
-                            if (rc <= 0) break;
-                            PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(match_data);
-                            size_t start = ovector[0];
-                            size_t end = ovector[1];
-                            if (print_filename) {
-                                printf("%s:", filename);
-                            }
-                            if (opts->line_number) {
-                                printf("%d:", i + 1);
-                            }
-                            if (opts->byte_offset) {
-                                printf("%zu:", lines[i].byte_offset + start);
-                            }
-                            printf("%.*s\n", (int)(end - start), lines[i].text + start);
-                            found = 1;
-                            offset = end;
-                            if (offset >= lines[i].len) break;
-                        }
-                        pcre2_match_data_free(match_data);
-                    } else { // basic, treat as fixed
-                        const char *pat = opts->patterns[0];
-                        const char *pos = lines[i].text;
-                        while ((pos = strstr(pos, pat)) != NULL) {
-                            if (print_filename) {
-                                printf("%s:", filename);
-                            }
-                            if (opts->line_number) {
-                                printf("%d:", i + 1);
-                            }
-                            if (opts->byte_offset) {
-                                printf("%zu:", lines[i].byte_offset + (pos - lines[i].text));
-                            }
-                            printf("%s\n", pat);
-                            pos += strlen(pat);
-                        }
-                    }
-                }
-            }
+        Chunk *c = &job->chunks[job->num_chunks++];
+        memset(c, 0, sizeof(*c));
+        c->start = p;
+        c->len = stop - p;
+        p = stop;
+    }
+    job->counting = w->opts.line_number;
+    job->remaining = job->num_chunks;
+    for (int i = job->num_chunks - 1; i >= 0; i--) {
+        Task task = { TASK_CHUNK, NULL, NULL, job, i, NULL, NULL };
+        pool_submit(w, task);
+    }
+}
+
+void pool_search_file(Worker *w, Task *task) {
+    WorkPool *pool = w->pool;
+    FileJob job;
+    file_job_init(&job, pool, task);
+    MappedFile mf;
+    if (search_is_stopped()) {
+        // -q has its answer; the file is not read.
+    } else if (task->type == TASK_NO_MATCH) {
+        w->found |= finish_without_match(task->path, &w->opts, pool->print_filename, &job.out);
+    } else if (pool->num_workers > 1 && chunks_allowed(&w->opts) && !w->opts.cache && map_file(task->path, &mf)) {
+        if (w->opts.decompress && compression_kind(mf.data, mf.size) != COMPRESS_NONE) {
+            unmap_file(&mf);
+            w->found |= process_file(task->path, &w->opts, pool->num_files, pool->print_filename, &job.out);
+        } else if (mf.size >= CHUNK_MIN_FILE && !buffer_is_binary(&w->opts, mf.data, mf.size)) {
+            FileJob *big = malloc(sizeof(FileJob));
+            *big = job;
+            big->out.ctx = big;
+            big->path = _strdup(task->path);
+            big->mf = mf;
+            InitializeCriticalSection(&big->lock);
+            file_job_split(w, big);
+            return;
+        } else {
+            w->found |= search_mapped_file(task->path, &mf, &w->opts, pool->print_filename, &job.out, NULL);
         }
     } else {
-        // Determine which lines to print
-        int *print_lines = calloc(num_lines, sizeof(int));
-        int has_context = opts->before_context > 0 || opts->after_context > 0;
-        for (int i = 0; i < num_lines; i++) {
-            if (lines[i].is_match) {
-                print_lines[i] = 1;
-                for (int j = i - opts->before_context; j <= i + opts->after_context; j++) {
-                    if (j >= 0 && j < num_lines) {
-                        print_lines[j] = 1;
-                    }
-                }
-            }
+        w->found |= process_file(task->path, &w->opts, pool->num_files, pool->print_filename, &job.out);
+    }
+    file_job_done(&job);
+}
+
+// The last chunk of a file is done: print what depends on the whole
+// file (-c, -l, -L) and release it.
+void file_job_finish(Worker *w, FileJob *job) {
+    SearchState st;
+    search_init(&st, &w->opts, job->path, w->pool->print_filename, &job->out);
+    for (int i = 0; i < job->num_chunks; i++) st.match_count += job->chunks[i].match_count;
+    search_finish(&st);
+    search_free(&st);
+    w->found |= st.found;
+    unmap_file(&job->mf);
+    file_job_done(job);
+    DeleteCriticalSection(&job->lock);
+    free(job->chunks);
+    free((char *)job->path);
+    free(job);
+}
+
+void pool_search_chunk(Worker *w, FileJob *job, int index) {
+    Chunk *c = &job->chunks[index];
+    // Once -q, -l or -L has its answer for the file, the chunks left are
+    // not searched, only accounted for.
+    int skip = search_is_stopped() || atomic_read(&job->decided);
+    if (job->counting) {
+        if (!skip) c->lines = count_lines(c->start, c->start + c->len, w->opts.null_data ? '\0' : '\n');
+        if (InterlockedDecrement(&job->remaining) > 0) return;
+        // Every chunk is counted: turn the counts into each chunk's first
+        // line number and search.
+        long long lines = 0;
+        for (int i = 0; i < job->num_chunks; i++) {
+            long long n = job->chunks[i].lines;
+            job->chunks[i].lines = lines;
+            lines += n;
+        }
+        job->counting = 0;
+        job->remaining = job->num_chunks;
+        for (int i = job->num_chunks - 1; i >= 0; i--) {
+            Task task = { TASK_CHUNK, NULL, NULL, job, i, NULL, NULL };
+            pool_submit(w, task);
         }
+        return;
+    }
 
-        // Output
-        int in_group = 0;
-        int printed_count = 0;
-        for (int i = 0; i < num_lines; i++) {
-            if (print_lines[i] && (opts->max_count == -1 || printed_count < opts->max_count)) {
-                if (!opts->quiet) {
-                    if (!in_group && has_context && !opts->no_group_separator) {
-                        printf("%s\n", opts->group_separator);
-                        in_group = 1;
-                    }
-                    if (print_filename) {
-                        printf("%s:", filename);
-                        if (opts->null_output) printf("\0");
-                    }
-                    if (opts->line_number) {
-                        printf("%d:", i + 1);
-                    }
-                    if (opts->byte_offset) {
-                        printf("%zu:", lines[i].byte_offset);
-                    }
-                    if (opts->initial_tab) {
-                        // add spaces for alignment, but simple
-                    }
-                    // color
-                    int is_tty = _isatty(_fileno(stdout));
-                    int use_color = opts->color && (opts->color_when == 1 || (opts->color_when == 2 && is_tty));
-                    if (use_color && lines[i].is_match) {
-                        printf("\33[01;31m");
-                    }
-                    printf("%s", lines[i].text);
-                    if (use_color && lines[i].is_match) {
-                        printf("\33[0m");
-                    }
-                    printf("\n");
-                    found = 1;
-                }
-                printed_count++;
+    SearchState st;
+    search_init(&st, &w->opts, job->path, w->pool->print_filename, &c->out);
+    st.line_no = c->lines;
+    st.offset = c->start - job->mf.data;
+    if (!skip) search_buffer(&st, c->start, c->len, 1);
+    search_free(&st);
+    if (st.done) InterlockedExchange(&job->decided, 1);
+
+    EnterCriticalSection(&job->lock);
+    c->match_count = st.match_count;
+    c->done = 1;
+    while (job->next_merge < job->num_chunks && job->chunks[job->next_merge].done) {
+        Chunk *m = &job->chunks[job->next_merge++];
+        if (m->out.len > 0) outbuf_write(&job->out, m->out.data, m->out.len);
+        free(m->out.data);
+        m->out.data = NULL;
+    }
+    int finished = job->next_merge == job->num_chunks;
+    LeaveCriticalSection(&job->lock);
+    if (finished) file_job_finish(w, job);
+}
+
+// Queue the entries of a directory on the worker's own deque.  They are
+// pushed last to first so that the worker takes them in order.
+void pool_read_directory(Worker *w, Task *task) {
+    WorkPool *pool = w->pool;
+    int count = 0;
+    Ignore *ignore = w->opts.gitignore ? ignore_enter(task->ignore, task->path) : NULL;
+    DirEntry *entries = search_is_stopped() ? NULL : read_directory(task->path, &w->opts, ignore, task->index, &count);
+    OutNode **children = NULL;
+    if (task->node && count > 0) {
+        children = malloc(count * sizeof(OutNode *));
+        for (int i = 0; i < count; i++) children[i] = out_node_new(task->node);
+    }
+    if (task->node) {
+        EnterCriticalSection(&pool->order_lock);
+        task->node->children = children;
+        task->node->num_children = count;
+        task->node->ready = 1;
+        pool_emit(pool);
+        LeaveCriticalSection(&pool->order_lock);
+    }
+    for (int i = count - 1; i >= 0; i--) {
+        int type = entries[i].is_dir ? TASK_DIR : entries[i].no_match ? TASK_NO_MATCH : TASK_FILE;
+        Task child = { type, entries[i].path, children ? children[i] : NULL, NULL, 0, NULL, task->index };
+        if (entries[i].is_dir) child.ignore = ignore_retain(ignore);
+        pool_submit(w, child);
+    }
+    free(entries);
+    ignore_release(ignore);
+    ignore_release(task->ignore);
+}
+
+int pool_find_task(Worker *w, Task *task) {
+    WorkPool *pool = w->pool;
+    if (deque_take(&w->deque, 0, task)) return 1;
+    // Start at a random victim so thieves spread out.
+    w->seed = w->seed * 1103515245 + 12345;
+    int first = (int)((w->seed >> 16) % pool->num_workers);
+    for (int i = 0; i < pool->num_workers; i++) {
+        Worker *victim = &pool->workers[(first + i) % pool->num_workers];
+        if (victim != w && deque_take(&victim->deque, 1, task)) return 1;
+    }
+    return 0;
+}
+
+DWORD WINAPI pool_worker(void *arg) {
+    Worker *w = arg;
+    WorkPool *pool = w->pool;
+    while (1) {
+        LONG pushes = atomic_read(&pool->pushes);
+        Task task;
+        if (pool_find_task(w, &task)) {
+            if (task.type == TASK_DIR) {
+                pool_read_directory(w, &task);
+            } else if (task.type == TASK_FILE || task.type == TASK_NO_MATCH) {
+                pool_search_file(w, &task);
             } else {
-                in_group = 0;
+                pool_search_chunk(w, task.job, task.chunk);
             }
+            free(task.path);
+            if (InterlockedDecrement(&pool->pending) == 0) {
+                EnterCriticalSection(&pool->idle_lock);
+                WakeAllConditionVariable(&pool->idle_cond);
+                LeaveCriticalSection(&pool->idle_lock);
+            }
+            continue;
+        }
+        // Nothing to take.  Sleep until a task is pushed, unless one was
+        // pushed since the deques were looked at or all work is done.
+        EnterCriticalSection(&pool->idle_lock);
+        if (atomic_read(&pool->pending) == 0) {
+            LeaveCriticalSection(&pool->idle_lock);
+            break;
+        }
+        if (atomic_read(&pool->pushes) == pushes) {
+            pool->sleeping++;
+            SleepConditionVariableCS(&pool->idle_cond, &pool->idle_lock, INFINITE);
+            pool->sleeping--;
         }
-        free(print_lines);
+        LeaveCriticalSection(&pool->idle_lock);
     }
+    return 0;
+}
+
+// Give a copy of the options its own matcher scratch state, for a search
+// thread: PCRE2 match data and DFA caches.  The compiled patterns are
+// shared.
+void options_thread_init(Options *opts) {
+    if (opts->code) regex_match_data_init(opts);
+    if (opts->regex) opts->regex = regex_clone(opts->regex);
+}
 
-    // Free lines
-    for (int i = 0; i < num_lines; i++) {
-        free(lines[i].text);
+int processor_count(void) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+}
+
+WorkPool *pool_new(Options *opts, int num_files, int print_filename) {
+    WorkPool *pool = calloc(1, sizeof(WorkPool));
+    pool->num_workers = opts->threads;
+    pool->num_files = num_files;
+    pool->print_filename = print_filename;
+    InitializeCriticalSection(&pool->idle_lock);
+    InitializeConditionVariable(&pool->idle_cond);
+    InitializeCriticalSection(&pool->order_lock);
+    InitializeConditionVariable(&pool->stream_cond);
+    if (opts->sort_path) {
+        pool->root = out_node_new(NULL);
+        pool->cursor = pool->root;
     }
-    free(lines);
-    return found;
+    pool->workers = calloc(pool->num_workers, sizeof(Worker));
+    for (int i = 0; i < pool->num_workers; i++) {
+        Worker *w = &pool->workers[i];
+        w->pool = pool;
+        w->seed = i + 1;
+        w->opts = *opts;
+        options_thread_init(&w->opts);
+        InitializeCriticalSection(&w->deque.lock);
+    }
+    return pool;
 }
 
-int process_directory(const char *dirname, Options *opts, int num_files, int print_filename) {
-    char path[1024];
-    sprintf(path, "%s\\*", dirname);
+// Queue a command-line operand.  Operands are dealt out to the workers in
+// turn so that all of them have work from the start.
+void pool_add(WorkPool *pool, int type, const char *path, SearchIndex *index) {
+    OutNode *node = NULL;
+    if (pool->root) {
+        OutNode *root = pool->root;
+        node = out_node_new(root);
+        root->children = realloc(root->children, (root->num_children + 1) * sizeof(OutNode *));
+        root->children[root->num_children++] = node;
+    }
+    Task task = { type, _strdup(path), node, NULL, 0, NULL, index };
+    pool_submit(&pool->workers[pool->next_worker++ % pool->num_workers], task);
+}
 
-    struct _finddata_t finddata;
+// Run every queued task and its descendants, then free the pool.  Returns
+// whether any file had a selected line.
+int pool_run(WorkPool *pool) {
     int found = 0;
-    intptr_t handle = _findfirst(path, &finddata);
-    if (handle == -1) {
-        if (errno != 0) perror(dirname);
-        return 0;
+    if (pool->root) {
+        // All operands are known now.
+        pool->root->ready = 1;
+        pool_emit(pool);
+    }
+    for (int i = 0; i < pool->num_workers; i++) {
+        Worker *w = &pool->workers[i];
+        w->thread = CreateThread(NULL, 0, pool_worker, w, 0, NULL);
+        if (!w->thread) pool_worker(w);
+    }
+    for (int i = 0; i < pool->num_workers; i++) {
+        Worker *w = &pool->workers[i];
+        if (w->thread) {
+            WaitForSingleObject(w->thread, INFINITE);
+            CloseHandle(w->thread);
+        }
     }
+    // Free the deques only once no worker can be stealing from them.
+    for (int i = 0; i < pool->num_workers; i++) {
+        Worker *w = &pool->workers[i];
+        found |= w->found;
+        free(w->deque.tasks);
+        DeleteCriticalSection(&w->deque.lock);
+    }
+    DeleteCriticalSection(&pool->idle_lock);
+    DeleteCriticalSection(&pool->order_lock);
+    free(pool->workers);
+    free(pool);
+    return found;
+}
 
-    do {
-        if (strcmp(finddata.name, ".") == 0 || strcmp(finddata.name, "..") == 0) continue;
+// Search standard input, named by --label.  It goes through the same
+// engine as files: mapped when it is a regular file read from the start,
+// read in blocks otherwise.
+int process_input(Options *opts, int print_filename) {
+    const char *name = opts->label ? opts->label : "(standard input)";
+    int fd = _fileno(stdin);
+    _setmode(fd, _O_BINARY);
 
-        snprintf(path, sizeof(path), "%s\\%s", dirname, finddata.name);
+    HANDLE in = (HANDLE)_get_osfhandle(fd);
+    HANDLE dup;
+    LARGE_INTEGER zero, pos;
+    zero.QuadPart = 0;
+    if (in != INVALID_HANDLE_VALUE && GetFileType(in) == FILE_TYPE_DISK && SetFilePointerEx(in, zero, &pos, FILE_CURRENT) &&
+        pos.QuadPart == 0 && DuplicateHandle(GetCurrentProcess(), in, GetCurrentProcess(), &dup, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+        MappedFile mf;
+        if (map_handle(dup, &mf)) return search_mapped_file(name, &mf, opts, print_filename, NULL, NULL);
+    }
 
-        if (finddata.attrib & _A_SUBDIR) {
-            int include_dir = 1;
-            if (opts->exclude_dir && match_glob(opts->exclude_dir, finddata.name)) include_dir = 0;
-            if (include_dir && opts->recursive) {
-                found |= process_directory(path, opts, num_files, print_filename);
-            }
-        } else {
-            int include = 1;
-            if (opts->include_glob && !match_glob(opts->include_glob, finddata.name)) include = 0;
-            if (opts->exclude_glob && match_glob(opts->exclude_glob, finddata.name)) include = 0;
-            if (opts->exclude_from) {
-                FILE *ef = fopen(opts->exclude_from, "r");
-                if (ef) {
-                    char buf[256];
-                    while (fgets(buf, sizeof(buf), ef)) {
-                        buf[strcspn(buf, "\r\n")] = 0;
-                        if (match_glob(buf, finddata.name)) {
-                            include = 0;
-                            break;
-                        }
-                    }
-                    fclose(ef);
-                }
-            }
-            if (include) {
-                found |= process_file(path, opts, num_files, print_filename);
+    SearchState st;
+    search_init(&st, opts, name, print_filename, NULL);
+    search_stream(&st, read_fd, &fd);
+    search_finish(&st);
+    search_free(&st);
+    return st.found;
+}
+
+// --follow.  Each file is searched to its end and then watched for data
+// appended to it, which is searched as it comes; the SearchState carries
+// line numbers and context from one read to the next.  A file that is
+// truncated, or whose name comes to refer to a new file as when logs are
+// rotated, is searched again from its start.  Directory change
+// notifications wake the loop early; it polls every FOLLOW_POLL_MS
+// regardless, since appends do not always raise one.
+#define FOLLOW_POLL_MS 1000
+
+typedef struct {
+    const char *path;
+    int fd;
+    int finished;
+    uint64_t file_id;
+    uint32_t volume;
+    long long pos;
+    char *buffer;
+    size_t used;
+    size_t capacity;
+    int first;
+    SearchState st;
+    HANDLE change;
+} FollowFile;
+
+// Open f->path and start a new search of it.  The file may be renamed or
+// deleted while it is open.
+int follow_open(FollowFile *f, Options *opts, int print_filename) {
+    HANDLE file = CreateFileA(f->path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return 0;
+    BY_HANDLE_FILE_INFORMATION info;
+    if (!GetFileInformationByHandle(file, &info)) {
+        CloseHandle(file);
+        return 0;
+    }
+    f->fd = _open_osfhandle((intptr_t)file, _O_RDONLY | _O_BINARY);
+    if (f->fd < 0) {
+        CloseHandle(file);
+        return 0;
+    }
+    f->file_id = (uint64_t)info.nFileIndexHigh << 32 | info.nFileIndexLow;
+    f->volume = info.dwVolumeSerialNumber;
+    f->pos = 0;
+    f->used = 0;
+    f->first = 1;
+    search_init(&f->st, opts, f->path, print_filename, NULL);
+    return 1;
+}
+
+// Search what was appended since the last call.  At eof a last line
+// without a terminator is searched too.
+void follow_read(FollowFile *f, int eof) {
+    while (!f->st.done && !search_is_stopped()) {
+        if (f->used == f->capacity) {
+            char *grown = realloc(f->buffer, f->capacity * 2);
+            if (!grown) {
+                perror("realloc");
+                break;
             }
+            f->buffer = grown;
+            f->capacity *= 2;
         }
-    } while (_findnext(handle, &finddata) == 0);
+        int n = _read(f->fd, f->buffer + f->used, (unsigned)(f->capacity - f->used));
+        if (n <= 0) break;
+        f->used += n;
+        f->pos += n;
+        if (f->first) {
+            f->first = 0;
+            if (!search_first_block(&f->st, f->buffer, f->used)) f->st.done = 1;
+        }
+        size_t consumed = search_buffer(&f->st, f->buffer, f->used, 0);
+        memmove(f->buffer, f->buffer + consumed, f->used - consumed);
+        f->used -= consumed;
+    }
+    if (eof && !f->st.done) search_buffer(&f->st, f->buffer, f->used, 1);
+}
 
-    _findclose(handle);
+// The current search of f is over.  Returns whether it selected a line.
+int follow_close(FollowFile *f) {
+    follow_read(f, 1);
+    search_finish(&f->st);
+    search_free(&f->st);
+    _close(f->fd);
+    f->fd = -1;
+    return f->st.found;
+}
+
+// Start over if the file was truncated or its name now refers to another
+// file.  Returns whether the search that ended selected a line.
+int follow_check(FollowFile *f, Options *opts, int print_filename) {
+    FileIdentity id;
+    // A name that is gone for now keeps the file that had it.
+    if (!file_identity(f->path, &id)) return 0;
+    if (id.file_id == f->file_id && id.volume == f->volume) {
+        if ((long long)id.size >= f->pos) return 0;
+        if (!opts->no_messages) fprintf(stderr, "grep: %s: file truncated\n", f->path);
+    } else if (!opts->no_messages) {
+        fprintf(stderr, "grep: %s: file replaced\n", f->path);
+    }
+    int found = follow_close(f);
+    if (follow_open(f, opts, print_filename)) follow_read(f, 0);
     return found;
 }
 
-int process_input(Options *opts, int num_files) {
-    if (opts->before_context || opts->after_context) {
-        fprintf(stderr, "grep: context not supported with stdin\n");
-        opts->before_context = opts->after_context = 0;
+void follow_wait(FollowFile *files, int count) {
+    HANDLE changes[MAXIMUM_WAIT_OBJECTS];
+    int n = 0;
+    for (int i = 0; i < count && n < MAXIMUM_WAIT_OBJECTS; i++) {
+        if (files[i].change != INVALID_HANDLE_VALUE) changes[n++] = files[i].change;
+    }
+    if (n == 0) {
+        Sleep(FOLLOW_POLL_MS);
+        return;
     }
+    DWORD r = WaitForMultipleObjects(n, changes, FALSE, FOLLOW_POLL_MS);
+    if (r < WAIT_OBJECT_0 + (DWORD)n) FindNextChangeNotification(changes[r - WAIT_OBJECT_0]);
+}
 
-    int line_num = 0;
-    int match_count = 0;
+// Follow the count files in paths until each is done (-m, -l) or -q has
+// its answer.  Returns whether any line was selected.
+int follow_files(Options *opts, char **paths, int count, int print_filename) {
+    FollowFile *files = calloc(count, sizeof(FollowFile));
     int found = 0;
-
-    if (opts->null_data) {
-        // Read all stdin, split by \0
-        size_t capacity = 1024;
-        size_t size = 0;
-        char *buffer = malloc(capacity);
-        if (!buffer) {
-            perror("malloc");
-            return 0;
-        }
-        int c;
-        while ((c = getchar()) != EOF) {
-            if (size >= capacity) {
-                capacity *= 2;
-                buffer = realloc(buffer, capacity);
-                if (!buffer) {
-                    perror("realloc");
-                    return 0;
-                }
-            }
-            buffer[size++] = c;
-        }
-        buffer[size] = '\0';
-
-        char *start = buffer;
-        char *end;
-        while ((end = strchr(start, '\0')) != NULL) {
-            size_t len = end - start;
-            line_num++;
-            int matches = match_line(opts, start);
-            if (matches) {
-                match_count++;
-                if (!opts->list_files && !opts->count) {
-                    if (opts->line_number) {
-                        printf("%d:", line_num);
-                    }
-                    printf("%.*s\n", (int)len, start);
-                }
-            }
-            start = end + 1;
-            if (start >= buffer + size) break;
+    for (int i = 0; i < count; i++) {
+        FollowFile *f = &files[i];
+        f->path = paths[i];
+        f->capacity = BLOCK_SIZE;
+        f->buffer = malloc(f->capacity);
+        f->change = INVALID_HANDLE_VALUE;
+        if (!follow_open(f, opts, print_filename)) {
+            if (!opts->no_messages) perror(f->path);
+            f->finished = 1;
+            continue;
         }
-        free(buffer);
-    } else {
-        char line[MAX_LINE];
-        while (fgets(line, sizeof(line), stdin)) {
-            line_num++;
-            size_t len = strlen(line);
-            while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) {
-                line[--len] = '\0';
-            }
+        char dir[1024];
+        snprintf(dir, sizeof(dir), "%s", f->path);
+        char *slash = strrchr(dir, '\\');
+        if (!slash) slash = strrchr(dir, '/');
+        if (slash) *slash = '\0';
+        else strcpy(dir, ".");
+        f->change = FindFirstChangeNotificationA(dir, FALSE, FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE |
+                                                 FILE_NOTIFY_CHANGE_LAST_WRITE);
+    }
 
-            int matches = match_line(opts, line);
-            if (matches) {
-                match_count++;
-                if (!opts->list_files && !opts->count) {
-                    if (opts->line_number) {
-                        printf("%d:", line_num);
-                    }
-                    printf("%s\n", line);
-                }
+    while (!search_is_stopped()) {
+        int live = 0;
+        for (int i = 0; i < count; i++) {
+            FollowFile *f = &files[i];
+            if (f->finished) continue;
+            // After a rotation the new file may not exist yet.
+            if (f->fd < 0 && !follow_open(f, opts, print_filename)) {
+                live++;
+                continue;
+            }
+            follow_read(f, 0);
+            if (f->st.done) {
+                found |= follow_close(f);
+                f->finished = 1;
+                continue;
             }
+            found |= follow_check(f, opts, print_filename);
+            live++;
         }
+        stdout_flush();
+        if (!live) break;
+        follow_wait(files, count);
     }
 
-    if (opts->count) {
-        printf("%d\n", match_count);
+    for (int i = 0; i < count; i++) {
+        if (files[i].fd >= 0 && !files[i].finished) found |= follow_close(&files[i]);
+        if (files[i].change != INVALID_HANDLE_VALUE) FindCloseChangeNotification(files[i].change);
+        free(files[i].buffer);
     }
+    free(files);
+    return found;
 }
 
 int main(int argc, char *argv[]) {
@@ -978,18 +6167,21 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    init_search_kernels();
+
     Options opts;
     int argi = 1;
     if (parse_options(argc, argv, &opts, &argi)) {
         return 1;
     }
+    if (opts.index_build) return index_build(opts.index_build, &opts);
 
     if (opts.num_patterns == 0 && opts.pattern_file == NULL) {
         if (argi >= argc) {
             print_usage();
             return 1;
         }
-        opts.patterns[opts.num_patterns++] = argv[argi];
+        add_patterns(&opts, argv[argi], strlen(argv[argi]));
         argi++;
     }
 
@@ -998,10 +6190,33 @@ int main(int argc, char *argv[]) {
 
     int any_matches = 0;
 
+    // Whether to color is decided once, here.
+    opts.color = opts.color && (opts.color_when == 1 || (opts.color_when == 2 && _isatty(_fileno(stdout))));
+    output_init(opts.line_buffered);
+
+    if (opts.only_matching && (opts.before_context > 0 || opts.after_context > 0)) {
+        fprintf(stderr, "grep: the -o option cannot be used with -A, -B, or -C\n");
+        opts.before_context = opts.after_context = 0;
+    }
+
+    if (opts.follow && num_files > 0) {
+        any_matches = follow_files(&opts, argv + argi, num_files, print_filename);
+        stdout_flush();
+        return any_matches ? 0 : 1;
+    }
+
+    if (opts.cache_file) opts.cache = cache_open(opts.cache_file, &opts, print_filename);
+
+    if (opts.threads == 0) opts.threads = processor_count();
+    WorkPool *pool = NULL;
+    if (num_files > 0 && opts.threads > 1) {
+        pool = pool_new(&opts, num_files, print_filename);
+    }
+
     if (num_files == 0) {
-        any_matches = process_input(&opts, num_files);
+        any_matches = process_input(&opts, print_filename);
     } else {
-        for (int j = argi; j < argc; j++) {
+        for (int j = argi; j < argc && !search_is_stopped(); j++) {
             const char *path = argv[j];
             DWORD attrib = GetFileAttributes(path);
             if (attrib == INVALID_FILE_ATTRIBUTES) {
@@ -1009,16 +6224,24 @@ int main(int argc, char *argv[]) {
                 continue;
             }
             if (attrib & FILE_ATTRIBUTE_DIRECTORY) {
-                if (opts.recursive) {
-                    any_matches |= process_directory(path, &opts, num_files, print_filename);
+                if (opts.recursive && pool) {
+                    pool_add(pool, TASK_DIR, path, opts.use_index ? index_load(path, &opts) : NULL);
+                } else if (opts.recursive) {
+                    SearchIndex *index = opts.use_index ? index_load(path, &opts) : NULL;
+                    any_matches |= process_directory(path, &opts, num_files, print_filename, NULL, index);
                 } else {
                     fprintf(stderr, "grep: %s: Is a directory\n", path);
                 }
+            } else if (pool) {
+                pool_add(pool, TASK_FILE, path, NULL);
             } else {
-                any_matches |= process_file(path, &opts, num_files, print_filename);
+                any_matches |= process_file(path, &opts, num_files, print_filename, NULL);
             }
         }
     }
+    if (pool) any_matches |= pool_run(pool);
+    stdout_flush();
+    if (opts.cache) cache_save(opts.cache);
 
     return any_matches ? 0 : 1;
 }
\ No newline at end of file